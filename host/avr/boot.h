@@ -0,0 +1,20 @@
+/*
+ * Host build of twiboot: minimal <avr/boot.h> replacement.
+ * SPM operations act on the simulated flash in mock.c.
+ */
+#ifndef _MOCK_AVR_BOOT_H_
+#define _MOCK_AVR_BOOT_H_
+
+#include <avr/io.h>
+
+#define boot_page_erase(address)        mock_page_erase(address)
+#define boot_page_fill(address, data)   mock_page_fill(address, data)
+#define boot_page_write(address)        mock_page_write(address)
+#define boot_rww_enable()               mock_rww_enable()
+#define boot_spm_busy()                 mock_spm_busy()
+#define boot_spm_busy_wait()            do {} while (boot_spm_busy())
+
+#define eeprom_is_ready()               !(EECR & (1<<EEPE))
+#define eeprom_busy_wait()              do {} while (!eeprom_is_ready())
+
+#endif /* _MOCK_AVR_BOOT_H_ */
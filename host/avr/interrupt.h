@@ -0,0 +1,16 @@
+/*
+ * Host build of twiboot: minimal <avr/interrupt.h> replacement.
+ * Interrupt handlers are plain functions, registered with mock_set_vector()
+ * and called by mock.c while interrupts are enabled.
+ */
+#ifndef _MOCK_AVR_INTERRUPT_H_
+#define _MOCK_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector, ...)                void vector(void)
+
+#define sei()                           mock_sei()
+#define cli()                           mock_cli()
+
+#endif /* _MOCK_AVR_INTERRUPT_H_ */
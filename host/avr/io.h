@@ -0,0 +1,131 @@
+/*
+ * Host build of twiboot: minimal <avr/io.h> replacement (atmega328p,
+ * atmega1284p with MOCK_ATMEGA1284P).
+ * Every register access goes through mock_access() which advances the
+ * simulated time and updates the simulated peripherals.
+ */
+#ifndef _MOCK_AVR_IO_H_
+#define _MOCK_AVR_IO_H_
+
+#include <stdint.h>
+#include "../mock.h"
+
+#if defined (MOCK_ATMEGA1284P)
+#define __AVR_ATmega1284P__     1
+#else
+#define __AVR_ATmega328P__      1
+#endif
+
+/* inline assembly has no meaning on the host: "asm volatile (...);" vanishes */
+#define asm
+#define __asm
+#define volatile(...)
+
+/* avr-gcc only function attributes */
+#define OS_main                 unused
+#define naked                   unused
+
+#define _BV(bit)                (1 << (bit))
+#define MOCK_REG(reg)           (*mock_access(reg))
+
+#define TWBR                    MOCK_REG(MOCK_TWBR)
+#define TWSR                    MOCK_REG(MOCK_TWSR)
+#define TWAR                    MOCK_REG(MOCK_TWAR)
+#define TWDR                    MOCK_REG(MOCK_TWDR)
+#define TWCR                    MOCK_REG(MOCK_TWCR)
+#define TWAMR                   MOCK_REG(MOCK_TWAMR)
+#define TCCR0B                  MOCK_REG(MOCK_TCCR0B)
+#define TCNT0                   MOCK_REG(MOCK_TCNT0)
+#define TIFR0                   MOCK_REG(MOCK_TIFR0)
+#define TIMSK0                  MOCK_REG(MOCK_TIMSK0)
+#define EECR                    MOCK_REG(MOCK_EECR)
+#define EEDR                    MOCK_REG(MOCK_EEDR)
+#define EEARL                   MOCK_REG(MOCK_EEARL)
+#define EEARH                   MOCK_REG(MOCK_EEARH)
+#define DDRB                    MOCK_REG(MOCK_DDRB)
+#define PORTB                   MOCK_REG(MOCK_PORTB)
+#define PINB                    MOCK_REG(MOCK_PINB)
+#define DDRC                    MOCK_REG(MOCK_DDRC)
+#define PORTC                   MOCK_REG(MOCK_PORTC)
+#define PINC                    MOCK_REG(MOCK_PINC)
+#define DDRD                    MOCK_REG(MOCK_DDRD)
+#define PORTD                   MOCK_REG(MOCK_PORTD)
+#define PIND                    MOCK_REG(MOCK_PIND)
+#define MCUSR                   MOCK_REG(MOCK_MCUSR)
+#define MCUCR                   MOCK_REG(MOCK_MCUCR)
+#define WDTCSR                  MOCK_REG(MOCK_WDTCSR)
+#define SMCR                    MOCK_REG(MOCK_SMCR)
+#define SPMCSR                  MOCK_REG(MOCK_SPMCSR)
+#define GPIOR0                  MOCK_REG(MOCK_GPIOR0)
+#define SREG                    MOCK_REG(MOCK_SREG)
+
+/* TWCR */
+#define TWINT                   7
+#define TWEA                    6
+#define TWSTA                   5
+#define TWSTO                   4
+#define TWWC                    3
+#define TWEN                    2
+#define TWIE                    0
+/* TWAR */
+#define TWGCE                   0
+/* TCCR0B */
+#define CS02                    2
+#define CS01                    1
+#define CS00                    0
+/* TIFR0 / TIMSK0 */
+#define TOV0                    0
+#define TOIE0                   0
+/* EECR */
+#define EEPM1                   5
+#define EEPM0                   4
+#define EERIE                   3
+#define EEMPE                   2
+#define EEPE                    1
+#define EERE                    0
+/* PORTB */
+#define PORTB4                  4
+#define PORTB5                  5
+/* PORTD */
+#define PORTD2                  2
+/* PINC */
+#define PINC0                   0
+#define PINC1                   1
+#define PINC4                   4
+#define PINC5                   5
+/* MCUSR */
+#define WDRF                    3
+#define BORF                    2
+#define EXTRF                   1
+#define PORF                    0
+/* MCUCR */
+#define IVSEL                   1
+#define IVCE                    0
+/* WDTCSR */
+#define WDIF                    7
+#define WDIE                    6
+#define WDCE                    4
+#define WDE                     3
+/* SMCR */
+#define SM0                     1
+#define SE                      0
+/* SPMCSR */
+#define SPMEN                   0
+
+#if defined (MOCK_ATMEGA1284P)
+#define SIGNATURE_0             0x1E
+#define SIGNATURE_1             0x97
+#define SIGNATURE_2             0x05
+#define RAMEND                  0x40FF
+#else
+#define SIGNATURE_0             0x1E
+#define SIGNATURE_1             0x95
+#define SIGNATURE_2             0x0F
+#define RAMEND                  0x8FF
+#endif
+
+#define SPM_PAGESIZE            MOCK_PAGE_SIZE
+#define FLASHEND                (MOCK_FLASH_SIZE -1)
+#define E2END                   (MOCK_EEPROM_SIZE -1)
+
+#endif /* _MOCK_AVR_IO_H_ */
@@ -0,0 +1,16 @@
+/*
+ * Host build of twiboot: minimal <avr/pgmspace.h> replacement.
+ */
+#ifndef _MOCK_AVR_PGMSPACE_H_
+#define _MOCK_AVR_PGMSPACE_H_
+
+#include <avr/io.h>
+
+#define PROGMEM
+/* near: 16bit address (LPM), far: 24bit address (RAMPZ, ELPM) */
+#define pgm_read_byte_near(address)     mock_flash_read((uint16_t)(address))
+#define pgm_read_word_near(address)     (pgm_read_byte_near(address) | (pgm_read_byte_near((address) +1) << 8))
+#define pgm_read_byte_far(address)      mock_flash_read(address)
+#define pgm_read_word_far(address)      (mock_flash_read(address) | (mock_flash_read((address) +1) << 8))
+
+#endif /* _MOCK_AVR_PGMSPACE_H_ */
@@ -0,0 +1,16 @@
+/*
+ * Host build of twiboot: minimal <avr/sleep.h> replacement.
+ */
+#ifndef _MOCK_AVR_SLEEP_H_
+#define _MOCK_AVR_SLEEP_H_
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE                 0x00
+
+#define set_sleep_mode(mode)            SMCR = (SMCR & ~(0x07<<SM0)) | (mode)
+#define sleep_enable()                  SMCR |= (1<<SE)
+#define sleep_disable()                 SMCR &= ~(1<<SE)
+#define sleep_cpu()                     mock_sleep()
+
+#endif /* _MOCK_AVR_SLEEP_H_ */
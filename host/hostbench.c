@@ -0,0 +1,1812 @@
+/***************************************************************************
+ *   Host build of twiboot: protocol test and throughput benchmark         *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; version 2 of the License,               *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include "mock.h"
+
+/* the unmodified bootloader, main() renamed */
+#define main twiboot_main
+#include "../main.c"
+#undef main
+
+#define PAGE_SIZE               MOCK_PAGE_SIZE
+#define READ_CHUNK              128
+
+struct snapshot
+{
+    uint64_t now;
+    struct mock_stats stats;
+};
+
+static uint8_t image[MOCK_FLASH_SIZE];
+static uint32_t image_size = 30720;
+
+
+/* *************************************************************************
+ * helpers
+ * ************************************************************************* */
+static void device_entry(void)
+{
+    jump_to_app = mock_app_start;
+
+#if (USE_INTERRUPTS)
+    mock_set_vector(MOCK_VECT_TIMER0_OVF, TIMER0_OVF_vect);
+    mock_set_vector(MOCK_VECT_TWI, TWI_vect);
+#endif /* (USE_INTERRUPTS) */
+
+    /* startup code in .init1 / .init3 */
+    init1();
+    disable_wdt_timer();
+
+    twiboot_main();
+}
+
+
+static void snapshot(struct snapshot *snap)
+{
+    snap->now = mock_now;
+    snap->stats = mock_stats;
+}
+
+
+static double ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+
+static void report(const char *name, uint32_t payload, struct snapshot *start)
+{
+    struct mock_stats *s = &mock_stats;
+    struct mock_stats *o = &start->stats;
+    uint64_t total = mock_now - start->now;
+    uint32_t transactions = s->transactions - o->transactions;
+    uint32_t bytes = s->data_bytes - o->data_bytes;
+
+    printf("%s @ %u kHz\n", name, mock_bus_hz / 1000);
+    printf("  %u transactions, %u data bytes, %.1f bytes/transaction, bus %.1f ms\n",
+           transactions, bytes,
+           transactions ? (double)bytes / transactions : 0.0,
+           ms((s->bus_bits - o->bus_bits) * (1000000000ULL / mock_bus_hz)));
+    printf("  spm busy %.1f ms (%u erase, %u write), eeprom busy %.1f ms (%u writes)\n",
+           ms(s->spm_busy_ns - o->spm_busy_ns),
+           s->page_erases - o->page_erases, s->page_writes - o->page_writes,
+           ms(s->ee_busy_ns - o->ee_busy_ns), s->ee_writes - o->ee_writes);
+    printf("  clock stretch %.1f ms, busy after stop %.1f ms, %u address polls, %u data nacks\n",
+           ms(s->stretch_ns - o->stretch_ns), ms(s->stop_busy_ns - o->stop_busy_ns),
+           s->addr_polls - o->addr_polls, s->data_nacks - o->data_nacks);
+    printf("  total %.1f ms", ms(total));
+    if (s->sleep_ns - o->sleep_ns)
+    {
+        printf(", cpu asleep %.1f%%", (s->sleep_ns - o->sleep_ns) * 100.0 / total);
+    }
+    if (payload && total)
+    {
+        printf(", %.2f kB/s", payload * 1e6 / total);
+    }
+    printf("\n");
+}
+
+
+static int check(const char *what, int ok)
+{
+    printf("  %-40s %s\n", what, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+
+static int check_errors(void)
+{
+    return check("no illegal SPM/EEPROM accesses", mock_stats.errors == 0);
+}
+
+
+/* *************************************************************************
+ * protocol
+ * ************************************************************************* */
+static uint16_t twi_write(const uint8_t *data, uint16_t len)
+{
+    return mock_i2c_write(TWI_ADDRESS, data, len);
+}
+
+
+static uint16_t twi_write_read(const uint8_t *wdata, uint16_t wlen, uint8_t *rdata, uint16_t rlen)
+{
+    return mock_i2c_write_read(TWI_ADDRESS, wdata, wlen, rdata, rlen);
+}
+
+
+/* CMD_ACCESS_MEMORY header, returns the offset of the first data byte */
+static uint16_t mem_header(uint8_t *msg, uint8_t memtype, uint32_t address)
+{
+    uint8_t i;
+
+    msg[0] = CMD_ACCESS_MEMORY;
+    msg[1] = memtype;
+    for (i = DATA_START -1; i >= 2; i--)
+    {
+        msg[i] = address & 0xFF;
+        address >>= 8;
+    }
+
+    return DATA_START;
+}
+
+
+static void abort_timeout(void)
+{
+    uint8_t msg[] = { CMD_WAIT };
+
+    twi_write(msg, sizeof(msg));
+}
+
+
+static void write_flash_pages(uint32_t size)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    uint32_t pos;
+
+    for (pos = 0; pos < size; pos += PAGE_SIZE)
+    {
+        mem_header(msg, MEMTYPE_FLASH, pos);
+        memcpy(&msg[DATA_START], &image[pos], PAGE_SIZE);
+        twi_write(msg, sizeof(msg));
+    }
+}
+
+
+static int read_flash_verify(uint32_t size)
+{
+    uint8_t msg[DATA_START];
+    uint8_t data[READ_CHUNK];
+    uint32_t pos;
+    int ok = 1;
+
+    for (pos = 0; pos < size; pos += READ_CHUNK)
+    {
+        mem_header(msg, MEMTYPE_FLASH, pos);
+        twi_write_read(msg, sizeof(msg), data, READ_CHUNK);
+
+        ok &= (memcmp(data, &image[pos], READ_CHUNK) == 0);
+    }
+
+    return ok;
+}
+
+
+/* *************************************************************************
+ * scenarios
+ * ************************************************************************* */
+static int scenario_protocol(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE] = { 0 };
+    uint8_t data[16];
+    int fail = 0;
+
+    mock_idle(1000000);
+
+    printf("protocol\n");
+
+    msg[0] = CMD_READ_VERSION;
+    twi_write_read(msg, 1, data, sizeof(info));
+    fail |= check("bootloader version", memcmp(data, VERSION_STRING, strlen(VERSION_STRING)) == 0);
+
+    mem_header(msg, MEMTYPE_CHIPINFO, 0);
+    twi_write_read(msg, DATA_START, data, sizeof(chipinfo));
+    fail |= check("chip info", (data[0] == SIGNATURE_0) && (data[1] == SIGNATURE_1) &&
+                               (data[2] == SIGNATURE_2) && (data[3] == (SPM_PAGESIZE & 0xFF)) &&
+#if (ADDR_BYTES > 2)
+                               (data[8] == (BOOTLOADER_START >> 16)) &&
+#endif
+#if (EEPROM_SUPPORT)
+                               (((data[6] << 8) | data[7]) == EEPROM_SIZE) &&
+#endif
+                               (((data[4] << 8) | data[5]) == (BOOTLOADER_START & 0xFFFF)));
+
+    fail |= check("boot timeout aborted", mock_app_started() == 0);
+
+#if (EEPROM_SUPPORT)
+    mem_header(msg, MEMTYPE_EEPROM, 0x0110);
+    memcpy(&msg[DATA_START], "\xA5\x5A\x00\xFF\x12\x34\x56\x78", 8);
+    twi_write(msg, DATA_START + 8);
+    fail |= check("eeprom write", memcmp(&mock_eeprom[0x110], &msg[DATA_START], 8) == 0);
+
+    memset(data, 0x00, sizeof(data));
+    twi_write_read(msg, DATA_START, data, 8);
+    fail |= check("eeprom read", memcmp(data, &msg[DATA_START], 8) == 0);
+
+#if (EEPROM_RESERVED)
+    {
+        uint8_t reserved[EEPROM_RESERVED];
+
+        /* write across the reported eeprom size: journal / address cells are kept */
+        memcpy(reserved, &mock_eeprom[EEPROM_SIZE], EEPROM_RESERVED);
+        mem_header(msg, MEMTYPE_EEPROM, EEPROM_SIZE -2);
+        memcpy(&msg[DATA_START], "\x11\x22\x33\x44\x55\x66\x77\x88", 8);
+        twi_write(msg, DATA_START + 8);
+        fail |= check("reserved eeprom protected", (memcmp(&mock_eeprom[EEPROM_SIZE -2], "\x11\x22", 2) == 0) &&
+                                                   (memcmp(&mock_eeprom[EEPROM_SIZE], reserved, EEPROM_RESERVED) == 0));
+    }
+#endif /* (EEPROM_RESERVED) */
+#endif /* (EEPROM_SUPPORT) */
+
+    mem_header(msg, MEMTYPE_FLASH, 0x1200);
+    memcpy(&msg[DATA_START], "0123456789abcdef", 16);
+    memset(&msg[DATA_START + 16], 0xFF, PAGE_SIZE - 16);
+    twi_write(msg, sizeof(msg));
+    fail |= check("flash page write", memcmp(&mock_flash[0x1200], &msg[DATA_START], PAGE_SIZE) == 0);
+
+    memset(data, 0x00, sizeof(data));
+    twi_write_read(msg, DATA_START, data, 16);
+    fail |= check("flash read", memcmp(data, &msg[DATA_START], 16) == 0);
+
+#if (ADDR_BYTES > 2)
+    mem_header(msg, MEMTYPE_FLASH, 0x11200);
+    twi_write(msg, sizeof(msg));
+    fail |= check("flash page write above 64kB", memcmp(&mock_flash[0x11200], &msg[DATA_START], PAGE_SIZE) == 0);
+
+    memset(data, 0x00, sizeof(data));
+    twi_write_read(msg, DATA_START, data, 16);
+    fail |= check("flash read above 64kB", memcmp(data, &msg[DATA_START], 16) == 0);
+#endif /* (ADDR_BYTES > 2) */
+
+    mem_header(msg, MEMTYPE_FLASH, BOOTLOADER_START);
+    memset(&msg[DATA_START], 0x00, PAGE_SIZE);
+    twi_write(msg, sizeof(msg));
+    fail |= check("bootloader section protected", mock_stats.errors == 0);
+
+    msg[0] = CMD_SWITCH_APPLICATION;
+    msg[1] = BOOTTYPE_APPLICATION;
+    twi_write(msg, 2);
+    mock_idle(100000);
+    fail |= check("start application", mock_app_started() != 0);
+
+    fail |= check_errors();
+    return fail;
+}
+
+
+static int scenario_boot(void)
+{
+    mock_idle(5000000000ULL);
+
+    printf("boot without bus traffic\n");
+    printf("  application started after %.3f ms", ms(mock_app_started()));
+    if (mock_stats.sleep_ns)
+    {
+        printf(", cpu asleep %.1f%%", mock_stats.sleep_ns * 100.0 / mock_app_started());
+    }
+    printf("\n");
+
+    return check("application started", mock_app_started() != 0);
+}
+
+
+static int scenario_handoff(void)
+{
+    uint8_t msg[] = { CMD_SWITCH_APPLICATION, BOOTTYPE_APPLICATION };
+    struct snapshot start;
+    uint64_t bus_ns;
+    int fail = 0;
+
+    /* former fixed delay: 65536 loops of nop, sbiw, brne (5 cycles) */
+    const uint64_t delay_ns = 65536ULL * 5 * 1000000000ULL / MOCK_CPU_HZ;
+
+    abort_timeout();
+
+    snapshot(&start);
+    twi_write(msg, sizeof(msg));
+    mock_idle(100000);
+    bus_ns = (mock_stats.bus_bits - start.stats.bus_bits) * (1000000000ULL / mock_bus_hz);
+
+    printf("boot command @ %u kHz\n", mock_bus_hz / 1000);
+    printf("  application started %.3f ms after the command (bus %.3f ms), fixed delay was %.1f ms\n",
+           ms(mock_app_started() - start.now), ms(bus_ns), ms(delay_ns));
+
+    fail |= check("application started after bus idle",
+                  (mock_app_started() - start.now) >= (bus_ns + BUS_IDLE_US * 1000ULL));
+#if (GENERAL_CALL_SUPPORT)
+    fail |= check("general call disabled for the application",
+                  mock_regs[MOCK_TWAR] == (TWI_ADDRESS << 1));
+#endif /* (GENERAL_CALL_SUPPORT) */
+
+    return fail;
+}
+
+
+static int scenario_flash(void)
+{
+    struct snapshot start;
+    int fail = 0;
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    write_flash_pages(image_size);
+    report("flash write, one page per transaction", image_size, &start);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+
+    snapshot(&start);
+    fail |= check("readback", read_flash_verify(image_size));
+    report("flash verify by readback", image_size, &start);
+
+    fail |= check_errors();
+    return fail;
+}
+
+
+#if (FLASH_STREAM_SUPPORT)
+static int scenario_stream(void)
+{
+    static uint8_t msg[DATA_START + MOCK_FLASH_SIZE];
+    struct snapshot start;
+    int fail = 0;
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    mem_header(msg, MEMTYPE_FLASH_STREAM, 0);
+    memcpy(&msg[DATA_START], image, image_size);
+
+    snapshot(&start);
+    twi_write(msg, DATA_START + image_size);
+    report("flash write, all pages streamed in one transaction", image_size, &start);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (FLASH_STREAM_SUPPORT) */
+
+
+#if (SKIP_UNCHANGED_PAGES)
+static int scenario_reflash(void)
+{
+    struct snapshot start;
+    int fail = 0;
+    uint32_t pos;
+
+    mock_idle(1000000);
+    abort_timeout();
+    write_flash_pages(image_size);
+
+    /* change one byte in every 16th page */
+    for (pos = 0; pos < image_size; pos += 16 * PAGE_SIZE)
+    {
+        image[pos] ^= 0x55;
+    }
+
+    snapshot(&start);
+    write_flash_pages(image_size);
+    report("flash write, 1/16 pages changed", image_size, &start);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (SKIP_UNCHANGED_PAGES) */
+
+
+#if (PAGE_CRC_SUPPORT)
+static uint16_t page_crc(const uint8_t *page)
+{
+    uint16_t crc = 0xFFFF;
+    uint16_t i;
+
+    for (i = 0; i < PAGE_SIZE; i++)
+    {
+        crc = _crc_xmodem_update(crc, page[i]);
+    }
+
+    return crc;
+}
+
+
+static int scenario_pagecrc(void)
+{
+    static uint8_t update[MOCK_FLASH_SIZE];
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    uint8_t map[2 * MOCK_FLASH_SIZE / PAGE_SIZE];
+    struct snapshot start;
+    uint32_t pages = image_size / PAGE_SIZE;
+    uint32_t changed = 0;
+    uint32_t i;
+    int fail = 0;
+
+    /* deployed firmware, new revision changes one byte in every 16th page */
+    memcpy(mock_flash, image, image_size);
+    memcpy(update, image, image_size);
+    for (i = 0; i < image_size; i += 16 * PAGE_SIZE)
+    {
+        update[i + 5] ^= 0x55;
+    }
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    mem_header(msg, MEMTYPE_PAGE_CRC, 0);
+    twi_write_read(msg, DATA_START, map, 2 * pages);
+    report("page crc map", 0, &start);
+    fail |= check("crc map", map[0] == (page_crc(image) >> 8) &&
+                             map[1] == (page_crc(image) & 0xFF) &&
+                             map[2 * pages -2] == (page_crc(&image[image_size - PAGE_SIZE]) >> 8));
+
+    /* no-op update: no page differs */
+    for (i = 0; i < pages; i++)
+    {
+        changed += (((map[2 * i] << 8) | map[2 * i +1]) != page_crc(&image[i * PAGE_SIZE]));
+    }
+    fail |= check("no-op update detected", changed == 0);
+
+    snapshot(&start);
+    mem_header(msg, MEMTYPE_PAGE_CRC, 0);
+    twi_write_read(msg, DATA_START, map, 2 * pages);
+    for (i = 0; i < pages; i++)
+    {
+        if (((map[2 * i] << 8) | map[2 * i +1]) != page_crc(&update[i * PAGE_SIZE]))
+        {
+            mem_header(msg, MEMTYPE_FLASH, i * PAGE_SIZE);
+            memcpy(&msg[DATA_START], &update[i * PAGE_SIZE], PAGE_SIZE);
+            twi_write(msg, sizeof(msg));
+            changed++;
+        }
+    }
+    report("crc map + changed pages", image_size, &start);
+    printf("  %u of %u pages written\n", changed, pages);
+    fail |= check("flash content", memcmp(mock_flash, update, image_size) == 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (PAGE_CRC_SUPPORT) */
+
+
+#if (CRC_SUPPORT)
+static int verify_flash_crc(void)
+{
+    uint8_t msg[DATA_START + 2];
+    uint16_t crc = 0xFFFF;
+    uint8_t data[2];
+    uint32_t i;
+
+    for (i = 0; i < image_size; i++)
+    {
+        crc = _crc_xmodem_update(crc, image[i]);
+    }
+
+    mem_header(msg, MEMTYPE_FLASH_CRC, 0);
+    msg[DATA_START] = image_size >> 8;
+    msg[DATA_START +1] = image_size & 0xFF;
+
+    twi_write(msg, sizeof(msg));
+    mock_i2c_read(TWI_ADDRESS, data, sizeof(data));
+
+    return (((data[0] << 8) | data[1]) == crc);
+}
+
+
+static int scenario_crc(void)
+{
+    uint8_t msg[DATA_START + 1];
+    struct snapshot start;
+    uint8_t data[2];
+    int fail = 0;
+    int ok;
+
+    memcpy(mock_flash, image, image_size);
+    mock_idle(1000000);
+
+    snapshot(&start);
+    ok = verify_flash_crc();
+    report("flash verify by crc", image_size, &start);
+    fail |= check("crc", ok);
+
+    /* STOP after the first length byte: no calculation */
+    mem_header(msg, MEMTYPE_FLASH_CRC, 0);
+    msg[DATA_START] = 0x01;
+    twi_write(msg, sizeof(msg));
+    mock_i2c_read(TWI_ADDRESS, data, sizeof(data));
+#if (STATUS_SUPPORT)
+    fail |= check("incomplete length reported", data[0] == STATUS_ERR_LENGTH);
+#else
+    fail |= check("incomplete length not answered", (data[0] == 0xFF) && (data[1] == 0xFF));
+#endif /* (STATUS_SUPPORT) */
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (CRC_SUPPORT) */
+
+
+#if (EEPROM_SUPPORT)
+#define EE_CHUNK                64
+
+static void write_eeprom_chunks(const uint8_t *data, uint16_t size)
+{
+    uint8_t msg[DATA_START + EE_CHUNK];
+    uint16_t pos;
+
+    for (pos = 0; pos < size; pos += EE_CHUNK)
+    {
+        mem_header(msg, MEMTYPE_EEPROM, pos);
+        memcpy(&msg[DATA_START], &data[pos], EE_CHUNK);
+        twi_write(msg, sizeof(msg));
+    }
+}
+
+
+static int scenario_eeprom(void)
+{
+    static uint8_t config[MOCK_EEPROM_SIZE];
+    struct snapshot start;
+    uint16_t i;
+    int fail = 0;
+
+    /* configuration block: random words, unused tail erased */
+    for (i = 0; i < sizeof(config); i++)
+    {
+        config[i] = (i < sizeof(config) / 2) ? image[i] : 0xFF;
+    }
+
+    memcpy(mock_eeprom, config, sizeof(config));
+    mock_idle(1000000);
+    abort_timeout();
+
+    /* a few bytes changed: erase only, write only, erase + write */
+    config[0x010] = 0xFF;
+    config[0x020] &= 0x0F;
+    config[0x030] = ~config[0x030];
+    config[0x040] = 0x5A;
+    config[sizeof(config) / 2 + 0x10] = 0x00;
+    config[sizeof(config) / 2 + 0x20] = 0x12;
+
+    snapshot(&start);
+    write_eeprom_chunks(config, sizeof(config));
+    report("eeprom write, 6 bytes changed", sizeof(config), &start);
+    fail |= check("eeprom content", memcmp(mock_eeprom, config, EEPROM_SIZE) == 0);
+
+#if (EEPROM_SKIP_UNCHANGED)
+    {
+        uint8_t msg[2] = { CMD_SWITCH_APPLICATION, BOOTTYPE_APPLICATION };
+
+        twi_write(msg, sizeof(msg));
+        mock_idle(100000);
+        fail |= check("application started", mock_app_started() != 0);
+        fail |= check("eeprom programming mode reset", (mock_regs[MOCK_EECR] & ((1<<EEPM1) | (1<<EEPM0))) == 0);
+    }
+#endif /* (EEPROM_SKIP_UNCHANGED) */
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (EEPROM_SUPPORT) */
+
+
+#if (EEPROM_STREAM_SUPPORT)
+static int scenario_eestream(void)
+{
+    static uint8_t msg[DATA_START + MOCK_EEPROM_SIZE];
+    struct snapshot start;
+    int fail = 0;
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    write_eeprom_chunks(image, MOCK_EEPROM_SIZE);
+    report("eeprom write, 64 bytes per transaction", MOCK_EEPROM_SIZE, &start);
+    fail |= check("eeprom content", memcmp(mock_eeprom, image, EEPROM_SIZE) == 0);
+
+    mem_header(msg, MEMTYPE_EEPROM_STREAM, 0);
+    memcpy(&msg[DATA_START], &image[MOCK_EEPROM_SIZE], MOCK_EEPROM_SIZE);
+
+    snapshot(&start);
+    twi_write(msg, sizeof(msg));
+    report("eeprom write, streamed in one transaction", MOCK_EEPROM_SIZE, &start);
+    fail |= check("eeprom content", memcmp(mock_eeprom, &msg[DATA_START], EEPROM_SIZE) == 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (EEPROM_STREAM_SUPPORT) */
+
+
+#if (BULK_ERASE_SUPPORT)
+static int scenario_erase(void)
+{
+    uint8_t msg[DATA_START + 2];
+    uint8_t data;
+    struct snapshot start;
+    uint16_t pages = image_size / PAGE_SIZE;
+    uint32_t pos;
+    int fail = 0;
+    int ok;
+
+    /* previous application in flash */
+    for (pos = 0; pos < BOOTLOADER_START; pos++)
+    {
+        mock_flash[pos] = ~image[pos];
+    }
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    mem_header(msg, MEMTYPE_FLASH_ERASE, 0);
+    msg[DATA_START] = pages >> 8;
+    msg[DATA_START +1] = pages & 0xFF;
+    twi_write(msg, sizeof(msg));
+    mock_i2c_read(TWI_ADDRESS, &data, 1);
+    report("bulk erase", 0, &start);
+
+    snapshot(&start);
+    write_flash_pages(image_size);
+    report("flash write, pages known blank", image_size, &start);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+    fail |= check("pages after range not erased", mock_flash[image_size] == (uint8_t)~image[image_size]);
+
+    /* erase marks are consumed, pages rewritten with erase */
+    write_flash_pages(PAGE_SIZE);
+    fail |= check("rewrite after write", memcmp(mock_flash, image, PAGE_SIZE) == 0);
+
+    /* 0 pages: whole application section, incomplete command ignored */
+    twi_write(msg, DATA_START + 1);
+    fail |= check("incomplete command ignored", mock_flash[0] == image[0]);
+
+    msg[DATA_START] = 0x00;
+    msg[DATA_START +1] = 0x00;
+    twi_write(msg, sizeof(msg));
+    mock_i2c_read(TWI_ADDRESS, &data, 1);
+    ok = 1;
+    for (pos = 0; pos < BOOTLOADER_START; pos++)
+    {
+        ok &= (mock_flash[pos] == 0xFF);
+    }
+    fail |= check("application section erased", ok);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (BULK_ERASE_SUPPORT) */
+
+
+#if (ERASE_AHEAD) || (ZERO_COPY_FLASH)
+static int scenario_abort(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    uint8_t data[16];
+    int fail = 0;
+
+    memcpy(mock_flash, image, image_size);
+    mock_idle(1000000);
+
+    printf("aborted page write\n");
+
+    /* erase started with the first data byte, page incomplete */
+    mem_header(msg, MEMTYPE_FLASH, 0x1200);
+    memset(&msg[DATA_START], ERASE_AHEAD ? 0xFF : 0x00, 16);
+    twi_write(msg, DATA_START + 16);
+
+    mem_header(msg, MEMTYPE_FLASH, 0x1300);
+    twi_write_read(msg, DATA_START, data, sizeof(data));
+    fail |= check("flash readable after abort", memcmp(data, &image[0x1300], sizeof(data)) == 0);
+#if (ERASE_AHEAD)
+    fail |= check("aborted page erased", mock_flash[0x1200] == 0xFF);
+#else
+    fail |= check("aborted page unchanged", mock_flash[0x1200] == image[0x1200]);
+#endif
+
+    /* ZERO_COPY_FLASH: no data of the aborted page in the page buffer */
+    memset(&msg[DATA_START], 0x5A, PAGE_SIZE);
+    twi_write(msg, sizeof(msg));
+    fail |= check("next page written", mock_flash[0x1300] == 0x5A);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (ERASE_AHEAD) || (ZERO_COPY_FLASH) */
+
+
+#if (FLASH_LZ_SUPPORT)
+/* greedy encoder of the compressed page format, returns the encoded size */
+static uint16_t lz_encode(const uint8_t *page, uint8_t *out)
+{
+    uint16_t pos = 0;
+    uint16_t len = 0;
+    int16_t literal = -1;
+
+    while (pos < PAGE_SIZE)
+    {
+        uint16_t best_len = 0;
+        uint16_t best_dist = 0;
+        uint16_t dist;
+
+        for (dist = 1; (dist <= pos) && (dist <= 256); dist++)
+        {
+            uint16_t i = 0;
+
+            while ((pos + i < PAGE_SIZE) && (i < 129) && (page[pos + i] == page[pos - dist + i]))
+            {
+                i++;
+            }
+
+            if (i > best_len)
+            {
+                best_len = i;
+                best_dist = dist;
+            }
+        }
+
+        if (best_len >= 3)
+        {
+            out[len++] = 0x80 | (best_len -2);
+            out[len++] = best_dist -1;
+            pos += best_len;
+            literal = -1;
+        }
+        else
+        {
+            /* start or extend a literal run */
+            if ((literal < 0) || (out[literal] == 0x7F))
+            {
+                literal = len;
+                out[len++] = 0xFF;
+            }
+
+            out[literal]++;
+            out[len++] = page[pos++];
+        }
+    }
+
+    return len;
+}
+
+
+/* one literal, then runs of 129 bytes over the whole page */
+#define LZ_RUNS                 ((PAGE_SIZE -1 + 128) / 129)
+
+static int scenario_lz(void)
+{
+    uint8_t msg[DATA_START + 2 * PAGE_SIZE];
+    uint8_t run[DATA_START + 2 + 2 * LZ_RUNS];
+    struct snapshot start;
+    uint32_t wire = 0;
+    uint32_t pos;
+    int fail = 0;
+    int ok;
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    for (pos = 0; pos < image_size; pos += PAGE_SIZE)
+    {
+        uint16_t len = lz_encode(&image[pos], &msg[DATA_START]);
+
+        mem_header(msg, MEMTYPE_FLASH_LZ, pos);
+        twi_write(msg, DATA_START + len);
+        wire += len;
+    }
+    report("flash write, compressed pages", image_size, &start);
+    printf("  %u compressed bytes for %u page bytes (%.1f%%)\n",
+           wire, image_size, wire * 100.0 / image_size);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+
+    /* one literal, then a run over the whole page: 0x5A, 0x5A, ... */
+    mem_header(run, MEMTYPE_FLASH_LZ, 0x1000);
+    run[DATA_START] = 0x00;
+    run[DATA_START +1] = 0x5A;
+    for (pos = 0; pos < LZ_RUNS; pos++)
+    {
+        run[DATA_START + 2 + 2 * pos] = 0xFF;
+        run[DATA_START + 3 + 2 * pos] = 0x00;
+    }
+
+    /* ERASE_AHEAD: the page was erased, but not written */
+    twi_write(run, DATA_START + 2);
+    fail |= check("incomplete page not written", mock_flash[0x1000] == (ERASE_AHEAD ? 0xFF : image[0x1000]));
+
+    run[DATA_START +3] = 0x01;
+    twi_write(run, sizeof(run));
+    fail |= check("reference before page start rejected", mock_flash[0x1000] == (ERASE_AHEAD ? 0xFF : image[0x1000]));
+
+    run[DATA_START +3] = 0x00;
+    twi_write(run, sizeof(run));
+    ok = 1;
+    for (pos = 0; pos < PAGE_SIZE; pos++)
+    {
+        ok &= (mock_flash[0x1000 + pos] == 0x5A);
+    }
+    fail |= check("run decoded", ok);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (FLASH_LZ_SUPPORT) */
+
+
+#if (FLASH_DELTA_SUPPORT)
+#define DELTA_HASH_SIZE         0x10000
+#define DELTA_CHAIN             64
+#define DELTA_MIN_COPY          (ADDR_BYTES +2)     /* shorter copies cost more than literals */
+
+static int32_t delta_head[DELTA_HASH_SIZE];
+static int32_t delta_prev[MOCK_FLASH_SIZE];
+static uint8_t delta_ref[MOCK_FLASH_SIZE];
+
+
+static uint16_t delta_hash(const uint8_t *p)
+{
+    return ((p[0] << 8) ^ (p[1] << 4) ^ p[2] ^ (p[3] << 12)) & (DELTA_HASH_SIZE -1);
+}
+
+
+/* hash chains of the deployed image, candidates are verified against delta_ref */
+static void delta_index(uint32_t size)
+{
+    uint32_t i;
+
+    memset(delta_head, 0xFF, sizeof(delta_head));
+    for (i = 0; i + 4 <= size; i++)
+    {
+        uint16_t h = delta_hash(&delta_ref[i]);
+
+        delta_prev[i] = delta_head[h];
+        delta_head[h] = i;
+    }
+}
+
+
+static uint16_t delta_match(uint32_t src, const uint8_t *page, uint16_t pos)
+{
+    uint16_t len = 0;
+
+    while ((src + len < BOOTLOADER_START) && (pos + len < PAGE_SIZE) && (len < 128) &&
+           (delta_ref[src + len] == page[pos + len]))
+    {
+        len++;
+    }
+
+    return len;
+}
+
+
+/* greedy diff of one page against the current flash content (delta_ref), returns the encoded size */
+static uint16_t delta_encode(const uint8_t *page, uint32_t pageaddr, uint8_t *out)
+{
+    uint32_t next_src = pageaddr;
+    uint16_t pos = 0;
+    uint16_t len = 0;
+    int16_t literal = -1;
+
+    while (pos < PAGE_SIZE)
+    {
+        /* candidates: continuation of the last copy, same address, hash chain */
+        uint32_t best_src = next_src;
+        uint16_t best_len = delta_match(next_src, page, pos);
+        uint16_t i;
+
+        i = delta_match(pageaddr + pos, page, pos);
+        if (i > best_len)
+        {
+            best_len = i;
+            best_src = pageaddr + pos;
+        }
+
+        if (pos + 4 <= PAGE_SIZE)
+        {
+            int32_t c = delta_head[delta_hash(&page[pos])];
+            uint16_t chain = DELTA_CHAIN;
+
+            while ((c >= 0) && chain--)
+            {
+                i = delta_match(c, page, pos);
+                if (i > best_len)
+                {
+                    best_len = i;
+                    best_src = c;
+                }
+                c = delta_prev[c];
+            }
+        }
+
+        if (best_len >= DELTA_MIN_COPY)
+        {
+            out[len++] = 0x80 | (best_len -1);
+            for (i = ADDR_BYTES; i > 0; i--)
+            {
+                out[len++] = best_src >> (8 * (i -1));
+            }
+            pos += best_len;
+            next_src = best_src + best_len;
+            literal = -1;
+        }
+        else
+        {
+            /* start or extend a literal run */
+            if ((literal < 0) || (out[literal] == 0x7F))
+            {
+                literal = len;
+                out[len++] = 0xFF;
+            }
+
+            out[literal]++;
+            out[len++] = page[pos++];
+            next_src++;
+        }
+    }
+
+    return len;
+}
+
+
+static int scenario_delta(void)
+{
+    static uint8_t update[MOCK_FLASH_SIZE];
+    uint8_t msg[DATA_START + 2 * PAGE_SIZE];
+    struct snapshot start;
+    uint32_t wire = 0;
+    uint32_t pos;
+    int fail = 0;
+
+    /* deployed firmware */
+    memcpy(mock_flash, image, image_size);
+    memcpy(delta_ref, mock_flash, BOOTLOADER_START);
+    delta_index(BOOTLOADER_START);
+
+    /* new revision: 16 bytes inserted at 10kB, 2 bytes changed every kB */
+    memcpy(update, image, image_size);
+    memmove(&update[0x2810], &update[0x2800], image_size - 0x2810);
+    memset(&update[0x2800], 0x42, 16);
+    for (pos = 0x100; pos < image_size; pos += 0x400)
+    {
+        update[pos] ^= 0x5A;
+        update[pos +1] ^= 0xA5;
+    }
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    for (pos = 0; pos < image_size; pos += PAGE_SIZE)
+    {
+        uint16_t len = delta_encode(&update[pos], pos, &msg[DATA_START]);
+
+        mem_header(msg, MEMTYPE_FLASH_DELTA, pos);
+        twi_write(msg, DATA_START + len);
+        wire += len;
+
+        /* later pages reference the updated flash */
+        memcpy(&delta_ref[pos], &update[pos], PAGE_SIZE);
+    }
+    report("flash write, delta pages", image_size, &start);
+    printf("  %u delta bytes for %u page bytes (%.1f%%)\n",
+           wire, image_size, wire * 100.0 / image_size);
+    fail |= check("flash content", memcmp(mock_flash, update, image_size) == 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (FLASH_DELTA_SUPPORT) */
+
+
+#if (STATUS_SUPPORT)
+#define STATUS_GAP_NS           1000000     /* master: delay between status reads */
+
+/* write, poll the status until not busy, returns the status byte */
+static uint8_t write_status(const uint8_t *msg, uint16_t len, uint16_t *pages)
+{
+    uint8_t data[3];
+
+    mock_i2c_write_poll(TWI_ADDRESS, msg, len, data, sizeof(data), STATUS_BUSY, STATUS_GAP_NS);
+    *pages = (data[1] << 8) | data[2];
+
+    return data[0];
+}
+
+
+static int scenario_status(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    struct snapshot start;
+    uint16_t pages = 0;
+    uint8_t state = 0;
+    uint8_t data[3];
+    uint32_t pos;
+    int fail = 0;
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    snapshot(&start);
+    for (pos = 0; pos < image_size; pos += PAGE_SIZE)
+    {
+        mem_header(msg, MEMTYPE_FLASH, pos);
+        memcpy(&msg[DATA_START], &image[pos], PAGE_SIZE);
+        state |= write_status(msg, sizeof(msg), &pages);
+    }
+    report("flash write, status polled", image_size, &start);
+    printf("  %u status reads while busy\n", mock_stats.status_polls - start.stats.status_polls);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+    fail |= check("status ok, page count", (state == 0x00) && (pages == image_size / PAGE_SIZE));
+    fail |= check("address ACKed while busy", mock_stats.addr_polls == start.stats.addr_polls);
+
+    /* errors */
+    mem_header(msg, MEMTYPE_FLASH, BOOTLOADER_START);
+    state = write_status(msg, sizeof(msg), &pages);
+    fail |= check("write to bootloader section", state == STATUS_ERR_ADDRESS);
+
+    mem_header(msg, MEMTYPE_FLASH, 0);
+    twi_write(msg, DATA_START + 16);
+    mock_i2c_read(TWI_ADDRESS, data, sizeof(data));
+    fail |= check("incomplete page", data[0] == STATUS_ERR_LENGTH);
+
+    state = write_status(msg, sizeof(msg), &pages);
+    fail |= check("error cleared", (state == 0x00) && (pages == image_size / PAGE_SIZE +1));
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (STATUS_SUPPORT) */
+
+
+#if (DESCRIPTOR_SUPPORT)
+static int scenario_descriptor(void)
+{
+    uint8_t msg[DATA_START];
+    uint8_t data[sizeof(descriptor)];
+    struct snapshot start;
+    uint32_t features;
+    int fail = 0;
+
+    mock_idle(1000000);
+
+    snapshot(&start);
+    mem_header(msg, MEMTYPE_DESCRIPTOR, 0);
+    twi_write_read(msg, sizeof(msg), data, sizeof(data));
+    report("capability descriptor", 0, &start);
+
+    features = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | (data[4] << 8) | data[5];
+    printf("  protocol %u, features 0x%08x, %u bytes per write, %u address bytes\n",
+           data[0], features, (data[6] << 8) | data[7], data[8]);
+    printf("  page erase %.1f ms, page write %.1f ms, eeprom byte %.1f ms\n",
+           data[9] / 10.0, data[10] / 10.0, data[11] / 10.0);
+
+    fail |= check("descriptor length", data[1] == sizeof(descriptor));
+    fail |= check("features", features == DESCRIPTOR_FEATURES);
+    fail |= check("layout", (((data[6] << 8) | data[7]) == PAGE_SIZE) && (data[8] == ADDR_BYTES));
+    fail |= check("times cover the simulated SPM / eeprom",
+                  (data[9] * 100000ULL >= MOCK_SPM_ERASE_NS) &&
+                  (data[10] * 100000ULL >= MOCK_SPM_WRITE_NS) &&
+                  (data[11] * 100000ULL >= MOCK_EE_ATOMIC_NS));
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (DESCRIPTOR_SUPPORT) */
+
+
+#if (JOURNAL_SUPPORT)
+/* start the journal of an image, returns the committed pages */
+static uint16_t journal_start(uint16_t id, uint16_t *stored_id)
+{
+    uint8_t msg[DATA_START + 2];
+    uint8_t data[JOURNAL_SIZE];
+
+    mem_header(msg, MEMTYPE_JOURNAL, 0);
+    msg[DATA_START] = id >> 8;
+    msg[DATA_START +1] = id & 0xFF;
+    twi_write(msg, sizeof(msg));
+    twi_write_read(msg, DATA_START, data, sizeof(data));
+
+    *stored_id = (data[0] << 8) | data[1];
+    return (data[2] << 8) | data[3];
+}
+
+
+static int scenario_journal(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    struct snapshot start;
+    uint32_t total = image_size / PAGE_SIZE;
+    uint32_t interrupted = total * 5 / 12;
+    uint16_t stored_id;
+    uint16_t pages;
+    uint32_t pos;
+    int fail = 0;
+
+    /* stale journal of an older transfer */
+    mock_eeprom[JOURNAL_ADDR] = 0xBE;
+    mock_eeprom[JOURNAL_ADDR +1] = 0xEF;
+    mock_eeprom[JOURNAL_PAGES_ADDR] = 0x00;
+    mock_eeprom[JOURNAL_PAGES_ADDR +1] = 50;
+
+    mock_idle(1000000);
+    abort_timeout();
+
+    /* other tool writes flash without journal */
+    mem_header(msg, MEMTYPE_FLASH, 0);
+    memset(&msg[DATA_START], 0x00, PAGE_SIZE);
+    twi_write(msg, sizeof(msg));
+    fail |= check("write without journal clears progress", mock_eeprom[JOURNAL_PAGES_ADDR +1] == 0);
+
+    pages = journal_start(0xBEEF, &stored_id);
+    fail |= check("journal started", (stored_id == 0xBEEF) && (pages == 0));
+
+    snapshot(&start);
+    write_flash_pages(interrupted * PAGE_SIZE);
+    report("flash write with journal, interrupted", interrupted * PAGE_SIZE, &start);
+
+    /* master restarts, resumes after the committed pages */
+    snapshot(&start);
+    pages = journal_start(0xBEEF, &stored_id);
+    printf("  %u of %u pages written, %u committed\n", interrupted, total, pages);
+    fail |= check("committed pages", pages == (interrupted / JOURNAL_INTERVAL * JOURNAL_INTERVAL));
+
+    for (pos = pages * PAGE_SIZE; pos < image_size; pos += PAGE_SIZE)
+    {
+        mem_header(msg, MEMTYPE_FLASH, pos);
+        memcpy(&msg[DATA_START], &image[pos], PAGE_SIZE);
+        twi_write(msg, sizeof(msg));
+    }
+    report("resumed flash write", image_size - pages * PAGE_SIZE, &start);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+
+    pages = journal_start(0xBEEF, &stored_id);
+    fail |= check("all pages committed", pages == (total / JOURNAL_INTERVAL * JOURNAL_INTERVAL));
+
+    pages = journal_start(0x1234, &stored_id);
+    fail |= check("other image starts at page 0", (stored_id == 0x1234) && (pages == 0));
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (JOURNAL_SUPPORT) */
+
+
+#if (SERVICE_TABLE_SUPPORT)
+/* the running application programs a new image through the service table */
+static int scenario_services(void)
+{
+    uint8_t msg[] = { CMD_SWITCH_APPLICATION, BOOTTYPE_APPLICATION };
+#if (EEPROM_SUPPORT)
+    static const uint8_t config[] = { 0x12, 0x34, 0x56, 0x78 };
+#endif /* (EEPROM_SUPPORT) */
+    struct snapshot start;
+    uint32_t pos;
+    uint16_t i;
+    int refused = 0;
+    int fail = 0;
+
+    twi_write(msg, sizeof(msg));
+    mock_idle(100000);
+    fail |= check("application started", mock_app_started() != 0);
+
+    snapshot(&start);
+    for (pos = 0; pos < image_size; pos += PAGE_SIZE)
+    {
+        refused |= service_page_erase(pos);
+        for (i = 0; i < PAGE_SIZE; i += 2)
+        {
+            service_page_fill(pos + i, image[pos + i] | (image[pos + i +1] << 8));
+        }
+        refused |= service_page_write(pos);
+    }
+    report("flash write by the application", image_size, &start);
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+    fail |= check("application pages accepted", refused == 0);
+
+    fail |= check("bootloader pages refused",
+                  (service_page_erase(BOOTLOADER_START) != 0) &&
+                  (service_page_write(BOOTLOADER_START) != 0));
+
+#if (EEPROM_SUPPORT)
+    snapshot(&start);
+    for (i = 0; i < sizeof(config); i++)
+    {
+        service_eeprom_write(0x10 + i, config[i]);
+    }
+    eeprom_busy_wait();
+    report("eeprom write by the application", sizeof(config), &start);
+    fail |= check("eeprom content", memcmp(&mock_eeprom[0x10], config, sizeof(config)) == 0);
+#endif /* (EEPROM_SUPPORT) */
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (SERVICE_TABLE_SUPPORT) */
+
+
+#if (STAGED_UPDATE_SUPPORT)
+/* new image in the staging area, old application with the first pages already copied */
+static void stage_image(uint16_t copied)
+{
+    uint16_t pages = STAGE_PAGES;
+    uint16_t sum = 0xFFFF;
+    uint32_t i;
+
+    for (i = 0; i < STAGE_START; i++)
+    {
+        mock_flash[STAGE_START + i] = image[i];
+        mock_flash[i] = (i < copied * PAGE_SIZE) ? image[i] : (image[i] ^ 0x55);
+        sum = _crc_xmodem_update(sum, image[i]);
+    }
+
+    mock_flash[STAGE_HEADER] = pages & 0xFF;
+    mock_flash[STAGE_HEADER +1] = pages >> 8;
+    mock_flash[STAGE_HEADER +2] = sum & 0xFF;
+    mock_flash[STAGE_HEADER +3] = sum >> 8;
+    mock_flash[STAGE_HEADER +4] = STAGE_MAGIC & 0xFF;
+    mock_flash[STAGE_HEADER +5] = STAGE_MAGIC >> 8;
+}
+
+
+static int scenario_staged(void)
+{
+    uint16_t copied = STAGE_PAGES / 4;
+    int fail = 0;
+
+    /* power loss after a quarter of the pages */
+    stage_image(copied);
+    mock_idle(5000000000ULL);
+
+    printf("staged image copied on boot\n");
+    printf("  %u of %u pages copied, spm busy %.1f ms (%u erase, %u write), application started after %.3f ms\n",
+           mock_stats.page_writes, STAGE_PAGES, ms(mock_stats.spm_busy_ns),
+           mock_stats.page_erases, mock_stats.page_writes, ms(mock_app_started()));
+
+    fail |= check("application content", memcmp(mock_flash, image, STAGE_START) == 0);
+    fail |= check("identical pages skipped", mock_stats.page_writes == (STAGE_PAGES - copied));
+    fail |= check("header erased", (mock_flash[STAGE_HEADER +4] == 0xFF) && (mock_flash[STAGE_HEADER +5] == 0xFF));
+    fail |= check("application started", mock_app_started() != 0);
+
+    fail |= check_errors();
+    return fail;
+}
+
+
+static int scenario_stagecrc(void)
+{
+    int fail = 0;
+
+    /* staged image incomplete */
+    stage_image(0);
+    mock_flash[STAGE_START + STAGE_START - 1] ^= 0x01;
+    mock_idle(5000000000ULL);
+
+    printf("corrupted staged image\n");
+    fail |= check("application kept", mock_flash[0] == (image[0] ^ 0x55));
+    fail |= check("nothing written", (mock_stats.page_erases == 0) && (mock_stats.page_writes == 0));
+    fail |= check("application started", mock_app_started() != 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (STAGED_UPDATE_SUPPORT) */
+
+
+#if (ADDRESS_ASSIGN_SUPPORT) || (ADDRESS_STRAP_PINS) || ((GROUP_ADDRESS_SUPPORT) && (TWI_GROUP_ADDRESS))
+/* device answers an abort timeout command at sla */
+static int answers(uint8_t sla)
+{
+    uint8_t msg[] = { CMD_WAIT };
+
+    return mock_i2c_write(sla, msg, sizeof(msg)) == sizeof(msg);
+}
+#endif /* (ADDRESS_ASSIGN_SUPPORT) || (ADDRESS_STRAP_PINS) || ((GROUP_ADDRESS_SUPPORT) && (TWI_GROUP_ADDRESS)) */
+
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+/* which: 0 slave address, 1 group address */
+static void assign(uint8_t sla, uint8_t which, uint8_t address, uint8_t complement)
+{
+    uint8_t msg[DATA_START + 2];
+
+    mem_header(msg, MEMTYPE_ADDRESS, which);
+    msg[DATA_START] = address;
+    msg[DATA_START +1] = complement;
+    mock_i2c_write(sla, msg, sizeof(msg));
+    mock_idle(10000000);
+}
+
+
+static int scenario_address(void)
+{
+    int fail = 0;
+
+    /* assigned in an earlier session */
+    mock_eeprom[ADDRESS_EEPROM_ADDR] = 0x30;
+    mock_idle(1000000);
+
+    printf("slave address assignment\n");
+    fail |= check("assigned address from eeprom", answers(0x30) && !answers(TWI_ADDRESS));
+
+    assign(0x30, 0, 0x42, ~0x42);
+    fail |= check("reassigned", answers(0x42) && !answers(0x30) &&
+                  (mock_eeprom[ADDRESS_EEPROM_ADDR] == 0x42));
+
+    assign(0x42, 0, 0x50, 0x50);
+    assign(0x42, 0, 0x78, ~0x78);
+    fail |= check("invalid address refused", answers(0x42) && (mock_eeprom[ADDRESS_EEPROM_ADDR] == 0x42));
+
+    assign(0x42, 0, 0xFF, 0x00);
+    fail |= check("assignment cleared", answers(TWI_ADDRESS) && !answers(0x42));
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+
+#if (ADDRESS_STRAP_PINS)
+static int scenario_strap(void)
+{
+    int fail = 0;
+
+    /* first strap pin jumpered to GND */
+    mock_regs[MOCK_PIND] = ~(1<<PORTD2);
+    mock_idle(1000000);
+
+    printf("slave address from strap pins\n");
+    fail |= check("strap pull-ups enabled", (mock_regs[MOCK_PORTD] & STRAP_MASK) == STRAP_MASK);
+    fail |= check("address with strap offset", answers(TWI_ADDRESS +1) && !answers(TWI_ADDRESS));
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (ADDRESS_STRAP_PINS) */
+
+
+#if (GROUP_ADDRESS_SUPPORT) && ((ADDRESS_ASSIGN_SUPPORT) || (TWI_GROUP_ADDRESS))
+#define GROUP_DEVICES           6
+
+/* differs from TWI_ADDRESS in one bit */
+#if (TWI_GROUP_ADDRESS)
+#define HOST_GROUP_ADDRESS      TWI_GROUP_ADDRESS
+#else
+#define HOST_GROUP_ADDRESS      0x21
+#endif
+
+static int scenario_group(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    uint8_t data[4];
+    struct snapshot start;
+    uint64_t write_ns;
+    uint8_t other = 0x01;
+    uint32_t pos;
+    int fail = 0;
+    int ok;
+
+#if (TWI_GROUP_ADDRESS == 0)
+    /* assigned in an earlier session */
+    mock_eeprom[GROUP_EEPROM_ADDR] = HOST_GROUP_ADDRESS;
+#endif
+    mock_idle(1000000);
+
+    printf("group address 0x%02x\n", HOST_GROUP_ADDRESS);
+    fail |= check("group and own address", answers(HOST_GROUP_ADDRESS) && answers(TWI_ADDRESS));
+
+    /* a bit outside of the address mask */
+    while ((TWI_ADDRESS ^ HOST_GROUP_ADDRESS) & other)
+    {
+        other <<= 1;
+    }
+    fail |= check("other addresses ignored", !answers(TWI_ADDRESS ^ other) && !answers(HOST_GROUP_ADDRESS ^ other));
+
+    /* all members ACK the SLA+R, none may drive SDA */
+    msg[0] = CMD_READ_VERSION;
+    mock_i2c_write_read(HOST_GROUP_ADDRESS, msg, 1, data, sizeof(data));
+    fail |= check("group read released", (data[0] == 0xFF) && (data[1] == 0xFF) && (data[3] == 0xFF));
+    twi_write_read(msg, 1, data, sizeof(data));
+    fail |= check("own address read", memcmp(data, VERSION_STRING, sizeof(data)) == 0);
+
+    snapshot(&start);
+    for (pos = 0; pos < image_size; pos += PAGE_SIZE)
+    {
+        mem_header(msg, MEMTYPE_FLASH, pos);
+        memcpy(&msg[DATA_START], &image[pos], PAGE_SIZE);
+        mock_i2c_write(HOST_GROUP_ADDRESS, msg, sizeof(msg));
+    }
+    report("flash write by group address", image_size, &start);
+    write_ns = mock_now - start.now;
+
+    /* each member verified by its own address */
+    snapshot(&start);
+#if (CRC_SUPPORT)
+    ok = verify_flash_crc();
+    report("flash verify by crc", image_size, &start);
+#else
+    ok = read_flash_verify(image_size);
+    report("flash verify by readback", image_size, &start);
+#endif /* (CRC_SUPPORT) */
+
+    printf("  %u group members: one by one %.1f ms, group write and verify each %.1f ms\n",
+           GROUP_DEVICES,
+           ms(GROUP_DEVICES * (write_ns + mock_now - start.now)),
+           ms(write_ns + GROUP_DEVICES * (mock_now - start.now)));
+
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+    fail |= check("verify", ok);
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+    assign(TWI_ADDRESS, 1, 0x00, 0xFF);
+    fail |= check("group left", !answers(HOST_GROUP_ADDRESS) && answers(TWI_ADDRESS));
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (GROUP_ADDRESS_SUPPORT) && ((ADDRESS_ASSIGN_SUPPORT) || (TWI_GROUP_ADDRESS)) */
+
+
+#if (GENERAL_CALL_SUPPORT)
+#define BROADCAST_DEVICES       16
+
+static int scenario_broadcast(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    struct snapshot start;
+    uint64_t write_ns;
+    uint32_t pos;
+    int fail = 0;
+    int ok;
+
+    mock_idle(1000000);
+
+    /* general call reset / write address of other devices */
+    msg[0] = 0x06;
+    mock_i2c_write(0x00, msg, 1);
+    msg[0] = 0x04;
+    mock_i2c_write(0x00, msg, 1);
+    mock_idle(100000);
+    fail |= check("other general call commands ignored", mock_app_started() == 0);
+
+    snapshot(&start);
+    for (pos = 0; pos < image_size; pos += PAGE_SIZE)
+    {
+        mem_header(msg, MEMTYPE_FLASH, pos);
+        memcpy(&msg[DATA_START], &image[pos], PAGE_SIZE);
+        mock_i2c_write(0x00, msg, sizeof(msg));
+    }
+    report("flash write by general call", image_size, &start);
+    write_ns = mock_now - start.now;
+
+    /* each device verified by its own address */
+    snapshot(&start);
+#if (CRC_SUPPORT)
+    ok = verify_flash_crc();
+    report("flash verify by crc", image_size, &start);
+#else
+    ok = read_flash_verify(image_size);
+    report("flash verify by readback", image_size, &start);
+#endif /* (CRC_SUPPORT) */
+
+    printf("  %u devices: one by one %.1f ms, broadcast and verify each %.1f ms\n",
+           BROADCAST_DEVICES,
+           ms(BROADCAST_DEVICES * (write_ns + mock_now - start.now)),
+           ms(write_ns + BROADCAST_DEVICES * (mock_now - start.now)));
+
+    fail |= check("flash content", memcmp(mock_flash, image, image_size) == 0);
+    fail |= check("verify", ok);
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (GENERAL_CALL_SUPPORT) */
+
+
+#if (FAST_BOOT)
+static void set_app_magic(void)
+{
+    mock_flash[APP_MAGIC_ADDR] = APP_MAGIC & 0xFF;
+    mock_flash[APP_MAGIC_ADDR +1] = APP_MAGIC >> 8;
+}
+
+
+static int scenario_fastboot(void)
+{
+    set_app_magic();
+    mock_idle(5000000000ULL);
+
+    printf("boot with valid application\n");
+    printf("  application started after %.3f ms\n", ms(mock_app_started()));
+
+    return check("application started", mock_app_started() != 0);
+}
+
+
+static int scenario_wdtboot(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE] = { 0 };
+    int fail = 0;
+
+    mem_header(msg, MEMTYPE_FLASH, 0);
+    set_app_magic();
+    mock_flash[APP_MAGIC_PAGE] = 0x12;
+    mock_regs[MOCK_MCUSR] = (1<<WDRF);
+    mock_idle(100000);
+
+    printf("watchdog reset with valid application\n");
+    fail |= check("bootloader requested", mock_app_started() == 0);
+
+    twi_write(msg, sizeof(msg));
+    fail |= check("marker cleared by flash write",
+                  (mock_flash[APP_MAGIC_ADDR] == 0x00) && (mock_flash[APP_MAGIC_ADDR +1] == 0x00));
+    fail |= check("marker page kept", mock_flash[APP_MAGIC_PAGE] == 0x12);
+
+    fail |= check_errors();
+    return fail;
+}
+
+
+#if (SKIP_UNCHANGED_PAGES)
+static int scenario_markerpage(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    int fail = 0;
+
+    /* application with marker, last page resent unchanged as the first write */
+    image[APP_MAGIC_ADDR] = APP_MAGIC & 0xFF;
+    image[APP_MAGIC_ADDR +1] = APP_MAGIC >> 8;
+    memcpy(&mock_flash[APP_MAGIC_PAGE], &image[APP_MAGIC_PAGE], PAGE_SIZE);
+    mock_regs[MOCK_MCUSR] = (1<<WDRF);
+    mock_idle(100000);
+
+    printf("unchanged marker page as first write\n");
+    mem_header(msg, MEMTYPE_FLASH, APP_MAGIC_PAGE);
+    memcpy(&msg[DATA_START], &image[APP_MAGIC_PAGE], PAGE_SIZE);
+    twi_write(msg, sizeof(msg));
+
+    fail |= check("marker page content",
+                  memcmp(&mock_flash[APP_MAGIC_PAGE], &image[APP_MAGIC_PAGE], PAGE_SIZE) == 0);
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (SKIP_UNCHANGED_PAGES) */
+
+
+#if (STAGED_UPDATE_SUPPORT)
+static int scenario_stagewrite(void)
+{
+    uint8_t msg[DATA_START + PAGE_SIZE];
+    int fail = 0;
+
+    set_app_magic();
+    mock_regs[MOCK_MCUSR] = (1<<WDRF);
+    mock_idle(100000);
+
+    printf("staged image written by the bootloader\n");
+    mem_header(msg, MEMTYPE_FLASH, STAGE_START);
+    memcpy(&msg[DATA_START], image, PAGE_SIZE);
+    twi_write(msg, sizeof(msg));
+
+    fail |= check("staged page written", memcmp(&mock_flash[STAGE_START], image, PAGE_SIZE) == 0);
+    fail |= check("application marker kept",
+                  (mock_flash[APP_MAGIC_ADDR] == (APP_MAGIC & 0xFF)) && (mock_flash[APP_MAGIC_ADDR +1] == (APP_MAGIC >> 8)));
+
+    fail |= check_errors();
+    return fail;
+}
+#endif /* (STAGED_UPDATE_SUPPORT) */
+#endif /* (FAST_BOOT) */
+
+
+static const struct scenario
+{
+    const char *name;
+    int (*func)(void);
+} scenarios[] = {
+    { "protocol",   scenario_protocol },
+    { "boot",       scenario_boot },
+    { "handoff",    scenario_handoff },
+    { "flash",      scenario_flash },
+#if (FLASH_STREAM_SUPPORT)
+    { "stream",     scenario_stream },
+#endif
+#if (SKIP_UNCHANGED_PAGES)
+    { "reflash",    scenario_reflash },
+#endif
+#if (CRC_SUPPORT)
+    { "crc",        scenario_crc },
+#endif
+#if (PAGE_CRC_SUPPORT)
+    { "pagecrc",    scenario_pagecrc },
+#endif
+#if (EEPROM_SUPPORT)
+    { "eeprom",     scenario_eeprom },
+#endif
+#if (EEPROM_STREAM_SUPPORT)
+    { "eestream",   scenario_eestream },
+#endif
+#if (BULK_ERASE_SUPPORT)
+    { "erase",      scenario_erase },
+#endif
+#if (ERASE_AHEAD) || (ZERO_COPY_FLASH)
+    { "abort",      scenario_abort },
+#endif
+#if (FLASH_LZ_SUPPORT)
+    { "lz",         scenario_lz },
+#endif
+#if (FLASH_DELTA_SUPPORT)
+    { "delta",      scenario_delta },
+#endif
+#if (STATUS_SUPPORT)
+    { "status",     scenario_status },
+#endif
+#if (DESCRIPTOR_SUPPORT)
+    { "descriptor", scenario_descriptor },
+#endif
+#if (JOURNAL_SUPPORT)
+    { "journal",    scenario_journal },
+#endif
+#if (SERVICE_TABLE_SUPPORT)
+    { "services",   scenario_services },
+#endif
+#if (STAGED_UPDATE_SUPPORT)
+    { "staged",     scenario_staged },
+    { "stagecrc",   scenario_stagecrc },
+#endif
+#if (ADDRESS_ASSIGN_SUPPORT)
+    { "address",    scenario_address },
+#endif
+#if (ADDRESS_STRAP_PINS)
+    { "strap",      scenario_strap },
+#endif
+#if (GROUP_ADDRESS_SUPPORT) && ((ADDRESS_ASSIGN_SUPPORT) || (TWI_GROUP_ADDRESS))
+    { "group",      scenario_group },
+#endif
+#if (GENERAL_CALL_SUPPORT)
+    { "broadcast",  scenario_broadcast },
+#endif
+#if (FAST_BOOT)
+    { "fastboot",   scenario_fastboot },
+    { "wdtboot",    scenario_wdtboot },
+#if (SKIP_UNCHANGED_PAGES)
+    { "markerpage", scenario_markerpage },
+#endif
+#if (STAGED_UPDATE_SUPPORT)
+    { "stagewrite", scenario_stagewrite },
+#endif
+#endif
+};
+
+
+/* every scenario starts with a freshly reset device in its own process */
+static int run_scenario(const struct scenario *sc)
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+
+    pid = fork();
+    if (pid == 0)
+    {
+        mock_init(device_entry, BOOTLOADER_START);
+        exit(sc->func());
+    }
+
+    if ((pid < 0) || (waitpid(pid, &status, 0) < 0))
+    {
+        perror("fork");
+        return 1;
+    }
+
+    printf("\n");
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+
+static void create_image(const char *filename)
+{
+    uint32_t seed = 0x12345678;
+    uint32_t i;
+
+    if (filename != NULL)
+    {
+        FILE *fp = fopen(filename, "rb");
+
+        if (fp == NULL)
+        {
+            perror(filename);
+            exit(1);
+        }
+
+        memset(image, 0xFF, sizeof(image));
+        image_size = fread(image, 1, BOOTLOADER_START, fp);
+        fclose(fp);
+    }
+    else
+    {
+        /* 3/4 code (random), 1/4 table of a repeated 32 byte record */
+        for (i = 0; i < image_size; i++)
+        {
+            if (i < (image_size / 4 * 3))
+            {
+                seed = seed * 1103515245 + 12345;
+                image[i] = seed >> 16;
+            }
+            else
+            {
+                image[i] = image[i - 32] + ((i % 32) == 0);
+            }
+        }
+    }
+
+    /* pad to full pages */
+    while (image_size % PAGE_SIZE)
+    {
+        image[image_size++] = 0xFF;
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *filename = NULL;
+    const char *only = NULL;
+    unsigned int i;
+    int fail = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:i:s:t:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                mock_bus_hz = atoi(optarg) * 1000;
+                break;
+
+            case 'i':
+                filename = optarg;
+                break;
+
+            case 's':
+                image_size = atoi(optarg);
+                if (image_size > BOOTLOADER_START)
+                {
+                    image_size = BOOTLOADER_START;
+                }
+                break;
+
+            case 't':
+                only = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-f bus kHz] [-i image.bin] [-s image size] [-t scenario]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    create_image(filename);
+
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if ((only == NULL) || (strcmp(only, scenarios[i].name) == 0))
+        {
+            fail |= run_scenario(&scenarios[i]);
+        }
+    }
+
+    printf("%s\n", fail ? "FAILED" : "all passed");
+    return fail;
+}
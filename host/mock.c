@@ -0,0 +1,1133 @@
+/***************************************************************************
+ *   Host build of twiboot: simulated AVR peripherals                      *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; version 2 of the License,               *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "mock.h"
+
+/*
+ * The firmware runs unmodified in its own context (ucontext) and accesses
+ * the peripherals through mock_access(). Each access costs MOCK_ACCESS_NS
+ * of simulated time, so busy-wait loops advance the clock.
+ *
+ * A register write can not be observed directly, its effect is evaluated
+ * on the next register access. Only TWCR is handed out in a write protected
+ * page: a write faults once and is applied on the next access, TWINT written
+ * as 1 marks the delivered TWI event as handled. Accesses of TIFR0 mark the
+ * end of one iteration of the polling loop in main(): there the next bus
+ * event is delivered and control returns to the driver once the queued bus
+ * transactions are done.
+ *
+ * With interrupts the firmware does not poll: enabling interrupts and idle
+ * sleep are the loop boundaries instead, pending TWI / timer0 events call
+ * the registered handlers (interrupts disabled while a handler runs).
+ *
+ * A TWCR access after polling the SPM / EEPROM busy flags is a boundary
+ * for the TWI as well: the firmware serves the bus from its busy-wait loops
+ * (status reads while a page is written). TWINT written as 1 reads as 0.
+ */
+
+#define BIT_TWINT               7
+#define BIT_TWEA                6
+#define BIT_TWEN                2
+#define BIT_TWGCE               0
+#define BIT_TOV0                0
+#define BIT_TOIE0               0
+#define BIT_TWIE                0
+#define BIT_SE                  0
+#define BIT_PORF                0
+#if defined (MOCK_ATMEGA1284P)
+#define BIT_SDA                 1
+#define BIT_SCL                 0
+#else
+#define BIT_SDA                 4
+#define BIT_SCL                 5
+#endif
+#define BIT_EEPM0               4
+#define BIT_EEMPE               2
+#define BIT_EEPE                1
+#define BIT_EERE                0
+
+enum {
+    OP_START_W,
+    OP_START_R,
+    OP_TX,
+    OP_RX_ACK,
+    OP_RX_NACK,
+    OP_STOP,
+};
+
+struct bus_op
+{
+    uint8_t type;
+    uint8_t data;
+    uint8_t *rx;
+};
+
+#define MAX_OPS                 0x12000
+#define MAX_POLLS               100000
+
+uint64_t mock_now;
+uint32_t mock_bus_hz = 100000;
+struct mock_stats mock_stats;
+uint8_t mock_flash[MOCK_FLASH_SIZE];
+uint8_t mock_eeprom[MOCK_EEPROM_SIZE];
+uint8_t mock_regs[MOCK_REG_COUNT];
+
+static uint32_t boot_start;
+
+static ucontext_t driver_ctx;
+static ucontext_t device_ctx;
+static uint8_t device_stack[256 * 1024];
+static uint64_t app_started;
+static uint64_t run_until;
+
+static uint16_t spm_temp[MOCK_PAGE_SIZE / 2];
+static uint64_t spm_busy_until;
+static uint8_t rww_busy;
+
+static uint64_t ee_busy_until;
+static uint8_t ee_busy;
+
+static uint64_t tov_next;
+static uint8_t tov_raised;
+
+static uint8_t pullup_portd;
+static uint64_t pullup_time;
+static uint8_t pind_read;
+
+static void (*vectors[MOCK_VECT_COUNT])(void);
+static uint8_t irq_enabled;
+
+static struct bus_op ops[MAX_OPS];
+static uint32_t op_head;
+static uint32_t op_count;
+static uint8_t twi_status;
+static uint8_t twi_seen;
+static uint8_t twi_addressed;
+static uint8_t twi_aborted;
+static uint32_t twi_polls;
+static uint64_t twi_delivered;
+static uint64_t twi_next;
+static uint64_t master_resume;
+static uint8_t twi_repstart;
+static uint8_t bus_open;
+static uint8_t twi_gc;
+static uint8_t twi_spin;
+static uint8_t twi_tx_last;
+static volatile uint8_t *twcr_page;
+static size_t twcr_page_size;
+static volatile sig_atomic_t twcr_written;
+static volatile sig_atomic_t twcr_writable;
+static uint64_t twcr_write_time;
+static uint16_t xfer_bytes;
+static uint32_t status_head;
+static uint32_t status_count;
+static uint64_t status_gap;
+
+
+static void mock_error(const char *msg, uint32_t address)
+{
+    fprintf(stderr, "mock: %s (0x%05x) at %.3f ms\n", msg, address, mock_now / 1e6);
+    mock_stats.errors++;
+}
+
+
+static uint64_t bit_ns(void)
+{
+    return 1000000000ULL / mock_bus_hz;
+}
+
+
+static uint8_t op_bits(uint8_t type)
+{
+    switch (type)
+    {
+        case OP_START_W:
+        case OP_START_R:
+            return 10;
+
+        case OP_STOP:
+            return 1;
+
+        default:
+            return 9;
+    }
+}
+
+
+static void op_next(void)
+{
+    op_head++;
+    if (op_head < op_count)
+    {
+        twi_next = mock_now + op_bits(ops[op_head].type) * bit_ns();
+    }
+}
+
+
+static void op_skip_transaction(void)
+{
+    while ((op_head < op_count) && (ops[op_head].type != OP_STOP))
+    {
+        op_head++;
+    }
+    op_next();
+    bus_open = 0;
+}
+
+
+/* *************************************************************************
+ * TWI
+ * ************************************************************************* */
+static void twi_deliver_event(uint8_t status)
+{
+    twi_status = status;
+    twi_seen = 0;
+    twi_delivered = mock_now;
+
+    mock_regs[MOCK_TWSR] = status;
+    mock_regs[MOCK_TWCR] |= (1<<BIT_TWINT);
+}
+
+
+static void twi_handled(uint64_t now)
+{
+    uint64_t duration = now - twi_delivered;
+
+    mock_regs[MOCK_TWCR] &= ~(1<<BIT_TWINT);
+
+    /* slave transmitter: TWDR was loaded for the next read byte */
+    if (((twi_status == 0xA8) || (twi_status == 0xB8)) &&
+        (op_head < op_count) && (ops[op_head].rx != NULL)
+       )
+    {
+        *ops[op_head].rx = mock_regs[MOCK_TWDR];
+
+        /* TWEA cleared: last byte, the slave leaves the transfer after it */
+        twi_tx_last = !(mock_regs[MOCK_TWCR] & (1<<BIT_TWEA));
+    }
+
+    if ((twi_status == 0xA0) || (twi_status == 0x88) || (twi_status == 0x98))
+    {
+        /*
+         * bus released, slave does not acknowledge its address until done:
+         * master addresses the slave again MOCK_POLL_GAP_NS after STOP
+         * (immediately after a repeated START) and retries until ACKed
+         */
+        uint64_t addr_ns = op_bits(OP_START_W) * bit_ns();
+        uint64_t period = addr_ns + op_bits(OP_STOP) * bit_ns() + MOCK_POLL_GAP_NS;
+        uint64_t offset = twi_repstart ? 0 : MOCK_POLL_GAP_NS;
+        uint64_t polls = 0;
+
+        if (duration > (offset + addr_ns))
+        {
+            polls = (duration - offset - addr_ns + period -1) / period;
+        }
+
+        mock_stats.stop_busy_ns += duration;
+        mock_stats.addr_polls += polls;
+        mock_stats.bus_bits += polls * (op_bits(OP_START_W) + op_bits(OP_STOP));
+        master_resume = twi_delivered + offset + polls * period;
+    }
+    else
+    {
+        /* SCL held low until TWINT is cleared */
+        mock_stats.stretch_ns += duration;
+        master_resume = now;
+    }
+
+    twi_status = 0;
+    if (op_head < op_count)
+    {
+        twi_next = master_resume + op_bits(ops[op_head].type) * bit_ns();
+    }
+}
+
+
+static uint8_t twi_address_match(uint8_t sla)
+{
+    /* general call: address 0x00 and TWGCE set */
+    twi_gc = (sla == 0x00);
+    if (twi_gc)
+    {
+        return (mock_regs[MOCK_TWAR] & (1<<BIT_TWGCE));
+    }
+
+    /* TWAMR: masked bits are ignored */
+    return (((mock_regs[MOCK_TWAR] >> 1) ^ sla) & ~(mock_regs[MOCK_TWAMR] >> 1)) == 0;
+}
+
+
+static void twi_deliver(void)
+{
+    struct bus_op *op = &ops[op_head];
+    uint8_t control = mock_regs[MOCK_TWCR];
+    uint8_t ack = (control & (1<<BIT_TWEA)) && (control & (1<<BIT_TWEN));
+
+    switch (op->type)
+    {
+        case OP_START_W:
+        case OP_START_R:
+        {
+            if (twi_addressed == 'W')
+            {
+                /* repeated START while addressed as receiver */
+                twi_addressed = 0;
+                twi_repstart = 1;
+                twi_deliver_event(0xA0);
+                break;
+            }
+
+            twi_addressed = 0;
+            bus_open = 1;
+            mock_stats.bus_bits += op_bits(op->type);
+
+            if (!twi_address_match(op->data))
+            {
+                op_skip_transaction();
+                break;
+            }
+
+            if (!ack)
+            {
+                /* address NACKed, master retries */
+                mock_stats.addr_polls++;
+                mock_stats.bus_bits += op_bits(OP_STOP);
+                twi_next = mock_now + (op_bits(op->type) + op_bits(OP_STOP)) * bit_ns() + MOCK_POLL_GAP_NS;
+
+                if (++twi_polls > MAX_POLLS)
+                {
+                    mock_error("slave does not acknowledge address", op->data);
+                    op_skip_transaction();
+                }
+                break;
+            }
+
+            twi_polls = 0;
+            twi_aborted = 0;
+            twi_tx_last = 0;
+            mock_stats.transactions++;
+            op_head++;
+
+            /* TWDR holds the received address byte */
+            mock_regs[MOCK_TWDR] = (op->data << 1) | (op->type == OP_START_R);
+
+            if (op->type == OP_START_W)
+            {
+                twi_addressed = 'W';
+                twi_deliver_event(twi_gc ? 0x70 : 0x60);
+            }
+            else
+            {
+                twi_addressed = 'R';
+                twi_deliver_event(0xA8);
+            }
+            break;
+        }
+
+        case OP_TX:
+            if (twi_addressed != 'W')
+            {
+                /* data NACKed before, master aborted the transfer */
+                if (twi_aborted)
+                {
+                    mock_stats.data_nacks++;
+                    twi_aborted = 0;
+                }
+                op_skip_transaction();
+                break;
+            }
+
+            op_head++;
+            mock_stats.bus_bits += op_bits(op->type);
+            mock_stats.data_bytes++;
+            xfer_bytes++;
+
+            mock_regs[MOCK_TWDR] = op->data;
+            if (twi_gc)
+            {
+                twi_deliver_event(ack ? 0x90 : 0x98);
+            }
+            else
+            {
+                twi_deliver_event(ack ? 0x80 : 0x88);
+            }
+
+            if (!ack)
+            {
+                twi_addressed = 0;
+                twi_repstart = 0;
+                twi_aborted = 1;
+            }
+            break;
+
+        case OP_RX_ACK:
+        case OP_RX_NACK:
+            op_head++;
+            mock_stats.bus_bits += op_bits(op->type);
+            mock_stats.data_bytes++;
+            xfer_bytes++;
+
+            if (twi_addressed != 'R')
+            {
+                /* slave left the transfer: SDA released, master reads 0xFF */
+                if (op->rx != NULL)
+                {
+                    *op->rx = 0xFF;
+                }
+                if (op_head < op_count)
+                {
+                    twi_next = mock_now + op_bits(ops[op_head].type) * bit_ns();
+                }
+            }
+            else if (twi_tx_last)
+            {
+                twi_addressed = 0;
+                twi_deliver_event((op->type == OP_RX_ACK) ? 0xC8 : 0xC0);
+            }
+            else if (op->type == OP_RX_ACK)
+            {
+                twi_deliver_event(0xB8);
+            }
+            else
+            {
+                twi_addressed = 0;
+                twi_deliver_event(0xC0);
+            }
+            break;
+
+        case OP_STOP:
+            mock_stats.bus_bits += op_bits(op->type);
+            bus_open = 0;
+            if (twi_addressed)
+            {
+                op_head++;
+                twi_addressed = 0;
+                twi_repstart = 0;
+                twi_deliver_event(0xA0);
+            }
+            else if ((op->rx != NULL) && (*op->rx & op->data))
+            {
+                /* status read: still busy, read again after the gap */
+                mock_stats.status_polls++;
+                op_head = status_head;
+                twi_next = mock_now + status_gap + op_bits(ops[op_head].type) * bit_ns();
+
+                if (++status_count > MAX_POLLS)
+                {
+                    mock_error("slave stays busy", *op->rx);
+                    op_head = op_count;
+                }
+            }
+            else
+            {
+                op_next();
+            }
+            break;
+    }
+}
+
+
+/* firmware writes TWCR: make the page writable, the write is repeated */
+static void twcr_fault(int sig, siginfo_t *info, void *context)
+{
+    (void)context;
+
+    if ((uint8_t *)info->si_addr != (uint8_t *)twcr_page)
+    {
+        /* real crash: fault again with the default action */
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    mprotect((void *)twcr_page, twcr_page_size, PROT_READ | PROT_WRITE);
+    twcr_writable = 1;
+    twcr_written = 1;
+    twcr_write_time = mock_now;
+}
+
+
+/* apply a TWCR write at the time it was done */
+static void twcr_commit(void)
+{
+    uint8_t control;
+
+    if (!twcr_written)
+    {
+        return;
+    }
+
+    twcr_written = 0;
+    control = *twcr_page;
+
+    /* TWINT written as 1 clears the flag, as 0 keeps it */
+    mock_regs[MOCK_TWCR] = (control & ~(1<<BIT_TWINT)) | (mock_regs[MOCK_TWCR] & (1<<BIT_TWINT));
+    if ((control & (1<<BIT_TWINT)) && twi_status)
+    {
+        twi_handled(twcr_write_time);
+    }
+}
+
+
+static volatile uint8_t *twcr_access(void)
+{
+    /* page is writable after a write, otherwise only updated on a change */
+    if (twcr_writable || (*twcr_page != mock_regs[MOCK_TWCR]))
+    {
+        if (!twcr_writable)
+        {
+            mprotect((void *)twcr_page, twcr_page_size, PROT_READ | PROT_WRITE);
+        }
+
+        *twcr_page = mock_regs[MOCK_TWCR];
+        mprotect((void *)twcr_page, twcr_page_size, PROT_READ);
+        twcr_writable = 0;
+    }
+
+    return twcr_page;
+}
+
+
+static void twi_sync(void)
+{
+    twcr_commit();
+
+    /* not handled yet (TWINT not written) */
+    if (twi_status)
+    {
+        return;
+    }
+
+    if ((op_head < op_count) && (mock_now >= twi_next))
+    {
+        twi_deliver();
+    }
+}
+
+
+/* *************************************************************************
+ * timer0
+ * ************************************************************************* */
+static uint64_t timer_prescaler(void)
+{
+    static const uint16_t prescaler[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+    return prescaler[mock_regs[MOCK_TCCR0B] & 0x07];
+}
+
+
+static void timer_sync(void)
+{
+    uint64_t prescaler = timer_prescaler();
+    uint64_t tick_ns = prescaler * 1000000000ULL / MOCK_CPU_HZ;
+
+    mock_regs[MOCK_TIFR0] &= ~(1<<BIT_TOV0);
+
+    if (tov_raised)
+    {
+        /* flag was seen and cleared, TCNT0 was reloaded by now */
+        tov_raised = 0;
+        tov_next = mock_now + (256 - mock_regs[MOCK_TCNT0]) * tick_ns;
+    }
+    else if (!prescaler)
+    {
+        tov_next = 0;
+    }
+    else if (!tov_next)
+    {
+        tov_next = mock_now + (256 - mock_regs[MOCK_TCNT0]) * tick_ns;
+    }
+    else if (mock_now >= tov_next)
+    {
+        tov_raised = 1;
+        mock_regs[MOCK_TIFR0] |= (1<<BIT_TOV0);
+    }
+}
+
+
+/* *************************************************************************
+ * eeprom
+ * ************************************************************************* */
+static void eeprom_sync(void)
+{
+    uint16_t address = ((mock_regs[MOCK_EEARH] << 8) | mock_regs[MOCK_EEARL]) % MOCK_EEPROM_SIZE;
+    uint8_t control = mock_regs[MOCK_EECR];
+
+    if (ee_busy && (mock_now >= ee_busy_until))
+    {
+        ee_busy = 0;
+        control &= ~(1<<BIT_EEPE);
+    }
+
+    if (control & (1<<BIT_EERE))
+    {
+        if (ee_busy)
+        {
+            mock_error("eeprom read while busy", address);
+        }
+
+        mock_regs[MOCK_EEDR] = mock_eeprom[address];
+        control &= ~(1<<BIT_EERE);
+    }
+
+    if ((control & (1<<BIT_EEPE)) && !ee_busy)
+    {
+        uint64_t duration;
+
+        if (!(control & (1<<BIT_EEMPE)))
+        {
+            mock_error("eeprom write without EEMPE", address);
+        }
+
+        if (mock_now < spm_busy_until)
+        {
+            mock_error("eeprom write while SPM busy", address);
+        }
+
+        switch ((control >> BIT_EEPM0) & 0x03)
+        {
+            case 0:
+                mock_eeprom[address] = mock_regs[MOCK_EEDR];
+                duration = MOCK_EE_ATOMIC_NS;
+                break;
+
+            case 1:
+                mock_eeprom[address] = 0xFF;
+                duration = MOCK_EE_ERASE_NS;
+                break;
+
+            default:
+                mock_eeprom[address] &= mock_regs[MOCK_EEDR];
+                duration = MOCK_EE_WRITE_NS;
+                break;
+        }
+
+        ee_busy = 1;
+        ee_busy_until = mock_now + duration;
+        control &= ~(1<<BIT_EEMPE);
+
+        mock_stats.ee_writes++;
+        mock_stats.ee_busy_ns += duration;
+    }
+
+    mock_regs[MOCK_EECR] = control;
+}
+
+
+/* *************************************************************************
+ * main loop iteration
+ * ************************************************************************* */
+static void loop_boundary(void)
+{
+    timer_sync();
+    twi_sync();
+
+    /* all queued transactions done, return to driver */
+    if (!twi_status && (op_head >= op_count) && (mock_now >= run_until))
+    {
+        swapcontext(&device_ctx, &driver_ctx);
+    }
+}
+
+
+/* *************************************************************************
+ * interrupts
+ * ************************************************************************* */
+static void irq_call(uint8_t vect)
+{
+    irq_enabled = 0;
+    vectors[vect]();
+    irq_enabled = 1;
+}
+
+
+/* run pending interrupt handlers, returns the number of handlers called */
+static uint8_t irq_dispatch(void)
+{
+    uint8_t count = 0;
+
+    twcr_commit();
+    while (irq_enabled)
+    {
+        loop_boundary();
+
+        if ((mock_regs[MOCK_TIMSK0] & (1<<BIT_TOIE0)) &&
+            (mock_regs[MOCK_TIFR0] & (1<<BIT_TOV0)) &&
+            (vectors[MOCK_VECT_TIMER0_OVF] != NULL)
+           )
+        {
+            /* flag cleared by hardware on entry */
+            mock_regs[MOCK_TIFR0] &= ~(1<<BIT_TOV0);
+            irq_call(MOCK_VECT_TIMER0_OVF);
+        }
+        else if (twi_status && !twi_seen &&
+                 (mock_regs[MOCK_TWCR] & (1<<BIT_TWIE)) &&
+                 (vectors[MOCK_VECT_TWI] != NULL)
+                )
+        {
+            irq_call(MOCK_VECT_TWI);
+        }
+        else
+        {
+            break;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+
+void mock_sei(void)
+{
+    mock_now += MOCK_ACCESS_NS;
+    irq_enabled = 1;
+    irq_dispatch();
+}
+
+
+void mock_cli(void)
+{
+    mock_now += MOCK_ACCESS_NS;
+    irq_enabled = 0;
+}
+
+
+void mock_sleep(void)
+{
+    mock_now += MOCK_ACCESS_NS;
+    if (!(mock_regs[MOCK_SMCR] & (1<<BIT_SE)))
+    {
+        return;
+    }
+
+    /* idle sleep until an interrupt was handled */
+    while (!irq_dispatch())
+    {
+        if (!irq_enabled)
+        {
+            mock_error("sleep with interrupts disabled", 0);
+            return;
+        }
+
+        mock_now += MOCK_SLEEP_STEP_NS;
+        mock_stats.sleep_ns += MOCK_SLEEP_STEP_NS;
+    }
+}
+
+
+/* *************************************************************************
+ * register access
+ * ************************************************************************* */
+volatile uint8_t *mock_access(uint8_t reg)
+{
+    mock_now += MOCK_ACCESS_NS;
+    twcr_commit();
+
+    /* pull-ups switched on since the last access */
+    if (mock_regs[MOCK_PORTD] & ~pullup_portd)
+    {
+        pullup_time = mock_now;
+    }
+    pullup_portd = mock_regs[MOCK_PORTD];
+
+    switch (reg)
+    {
+        case MOCK_TWCR:
+            /* busy-wait loop: the previous TWCR write is done */
+            if (twi_spin)
+            {
+                twi_spin = 0;
+                twi_sync();
+            }
+
+            if (twi_status)
+            {
+                twi_seen = 1;
+            }
+            else
+            {
+                /* TWINT polled: the next access may see the next event */
+                twi_spin = 1;
+            }
+            return twcr_access();
+
+        case MOCK_EECR:
+            twi_spin = 1;
+            eeprom_sync();
+            break;
+
+        case MOCK_EEDR:
+        case MOCK_EEARL:
+        case MOCK_EEARH:
+            eeprom_sync();
+            break;
+
+        case MOCK_PINC:
+            /* SDA / SCL: both high while no transaction is open */
+            twi_sync();
+            if (bus_open)
+            {
+                mock_regs[MOCK_PINC] &= ~((1<<BIT_SDA) | (1<<BIT_SCL));
+            }
+            else
+            {
+                mock_regs[MOCK_PINC] |= (1<<BIT_SDA) | (1<<BIT_SCL);
+            }
+            break;
+
+        case MOCK_TIFR0:
+            loop_boundary();
+            break;
+
+        case MOCK_PIND:
+            /* port D inputs: still low while the pull-ups charge the pins */
+            pind_read = mock_regs[MOCK_PIND];
+            if (mock_now < pullup_time + MOCK_PULLUP_NS)
+            {
+                pind_read &= ~mock_regs[MOCK_PORTD];
+            }
+            return &pind_read;
+
+        default:
+            break;
+    }
+
+    return &mock_regs[reg];
+}
+
+
+/* *************************************************************************
+ * SPM
+ * ************************************************************************* */
+uint8_t mock_spm_busy(void)
+{
+    mock_now += MOCK_ACCESS_NS;
+    twi_spin = 1;
+
+    return (mock_now < spm_busy_until);
+}
+
+
+static uint8_t spm_check(const char *op, uint32_t address)
+{
+    if (mock_now < spm_busy_until)
+    {
+        mock_error(op, address);
+        return 0;
+    }
+
+    if (mock_now < ee_busy_until)
+    {
+        mock_error("SPM while eeprom busy", address);
+    }
+
+    return 1;
+}
+
+
+void mock_page_erase(uint32_t address)
+{
+    uint32_t page = address & ~(MOCK_PAGE_SIZE -1);
+
+    mock_now += MOCK_ACCESS_NS;
+    if (!spm_check("page erase while SPM busy", address))
+    {
+        return;
+    }
+
+    if (page >= boot_start)
+    {
+        mock_error("page erase in bootloader section", address);
+        return;
+    }
+
+    memset(&mock_flash[page], 0xFF, MOCK_PAGE_SIZE);
+    spm_busy_until = mock_now + MOCK_SPM_ERASE_NS;
+    rww_busy = 1;
+
+    mock_stats.page_erases++;
+    mock_stats.spm_busy_ns += MOCK_SPM_ERASE_NS;
+}
+
+
+void mock_page_fill(uint32_t address, uint16_t data)
+{
+    mock_now += MOCK_ACCESS_NS;
+    if (!spm_check("page fill while SPM busy", address))
+    {
+        return;
+    }
+
+    /* a word can only be loaded once until the buffer is cleared */
+    spm_temp[(address % MOCK_PAGE_SIZE) / 2] &= data;
+}
+
+
+void mock_page_write(uint32_t address)
+{
+    uint32_t page = address & ~(MOCK_PAGE_SIZE -1);
+    uint16_t i;
+
+    mock_now += MOCK_ACCESS_NS;
+    if (!spm_check("page write while SPM busy", address))
+    {
+        return;
+    }
+
+    if (page >= boot_start)
+    {
+        mock_error("page write in bootloader section", address);
+        return;
+    }
+
+    /* programming can only clear bits */
+    for (i = 0; i < MOCK_PAGE_SIZE / 2; i++)
+    {
+        mock_flash[page + 2 * i] &= spm_temp[i] & 0xFF;
+        mock_flash[page + 2 * i +1] &= spm_temp[i] >> 8;
+        spm_temp[i] = 0xFFFF;
+    }
+
+    spm_busy_until = mock_now + MOCK_SPM_WRITE_NS;
+    rww_busy = 1;
+
+    mock_stats.page_writes++;
+    mock_stats.spm_busy_ns += MOCK_SPM_WRITE_NS;
+}
+
+
+void mock_rww_enable(void)
+{
+    mock_now += MOCK_ACCESS_NS;
+    if (spm_check("rww enable while SPM busy", 0))
+    {
+        /* RWWSRE also clears the page buffer */
+        rww_busy = 0;
+        memset(spm_temp, 0xFF, sizeof(spm_temp));
+    }
+}
+
+
+uint8_t mock_flash_read(uint32_t address)
+{
+    mock_now += MOCK_ACCESS_NS;
+    address %= MOCK_FLASH_SIZE;
+
+    if (rww_busy && (address < boot_start))
+    {
+        mock_error("RWW section read while busy", address);
+        return 0xFF;
+    }
+
+    return mock_flash[address];
+}
+
+
+/* *************************************************************************
+ * driver side
+ * ************************************************************************* */
+void mock_init(void (*entry)(void), uint32_t bootloader_start)
+{
+    boot_start = bootloader_start;
+
+    memset(mock_flash, 0xFF, sizeof(mock_flash));
+    memset(mock_eeprom, 0xFF, sizeof(mock_eeprom));
+    memset(spm_temp, 0xFF, sizeof(spm_temp));
+    mock_regs[MOCK_TWSR] = 0xF8;
+    mock_regs[MOCK_MCUSR] = (1<<BIT_PORF);
+    /* unconnected pins with pull-ups */
+    mock_regs[MOCK_PIND] = 0xFF;
+
+    /* TWCR writes are detected by a page fault */
+    {
+        struct sigaction sa;
+
+        twcr_page_size = sysconf(_SC_PAGESIZE);
+        twcr_page = mmap(NULL, twcr_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (twcr_page == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(1);
+        }
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = twcr_fault;
+        sa.sa_flags = SA_SIGINFO;
+        sigaction(SIGSEGV, &sa, NULL);
+    }
+
+    getcontext(&device_ctx);
+    device_ctx.uc_stack.ss_sp = device_stack;
+    device_ctx.uc_stack.ss_size = sizeof(device_stack);
+    device_ctx.uc_link = &driver_ctx;
+    makecontext(&device_ctx, entry, 0);
+}
+
+
+void mock_set_vector(uint8_t vect, void (*isr)(void))
+{
+    vectors[vect] = isr;
+}
+
+
+void mock_app_start(void)
+{
+    app_started = mock_now ? mock_now : 1;
+
+    for (;;)
+    {
+        swapcontext(&device_ctx, &driver_ctx);
+    }
+}
+
+
+uint64_t mock_app_started(void)
+{
+    return app_started;
+}
+
+
+static void bus_add(uint8_t type, uint8_t data, uint8_t *rx)
+{
+    if (op_count >= MAX_OPS)
+    {
+        mock_error("bus transaction too long", op_count);
+        return;
+    }
+
+    ops[op_count].type = type;
+    ops[op_count].data = data;
+    ops[op_count].rx = rx;
+    op_count++;
+}
+
+
+static void bus_add_read(uint8_t sla, uint8_t *rdata, uint16_t rlen)
+{
+    uint16_t i;
+
+    bus_add(OP_START_R, sla, NULL);
+    for (i = 0; i < rlen; i++)
+    {
+        bus_add((i == rlen -1) ? OP_RX_NACK : OP_RX_ACK, 0, &rdata[i]);
+    }
+}
+
+
+static uint16_t bus_run(void)
+{
+    xfer_bytes = 0;
+
+    if (app_started)
+    {
+        op_head = op_count = 0;
+        return 0;
+    }
+
+    if (master_resume < mock_now)
+    {
+        master_resume = mock_now;
+    }
+
+    twi_next = master_resume + op_bits(ops[0].type) * bit_ns();
+    swapcontext(&driver_ctx, &device_ctx);
+
+    op_head = op_count = 0;
+    return xfer_bytes;
+}
+
+
+uint16_t mock_i2c_write(uint8_t sla, const uint8_t *data, uint16_t len)
+{
+    uint16_t i;
+
+    bus_add(OP_START_W, sla, NULL);
+    for (i = 0; i < len; i++)
+    {
+        bus_add(OP_TX, data[i], NULL);
+    }
+    bus_add(OP_STOP, 0, NULL);
+
+    return bus_run();
+}
+
+
+uint16_t mock_i2c_write_read(uint8_t sla, const uint8_t *wdata, uint16_t wlen,
+                             uint8_t *rdata, uint16_t rlen)
+{
+    uint16_t i;
+
+    bus_add(OP_START_W, sla, NULL);
+    for (i = 0; i < wlen; i++)
+    {
+        bus_add(OP_TX, wdata[i], NULL);
+    }
+    bus_add_read(sla, rdata, rlen);
+    bus_add(OP_STOP, 0, NULL);
+
+    return bus_run();
+}
+
+
+uint16_t mock_i2c_write_poll(uint8_t sla, const uint8_t *wdata, uint16_t wlen,
+                             uint8_t *rdata, uint16_t rlen, uint8_t busy, uint64_t gap_ns)
+{
+    uint16_t i;
+
+    bus_add(OP_START_W, sla, NULL);
+    for (i = 0; i < wlen; i++)
+    {
+        bus_add(OP_TX, wdata[i], NULL);
+    }
+    bus_add(OP_STOP, 0, NULL);
+
+    /* repeated until (rdata[0] & busy) == 0 */
+    status_head = op_count;
+    status_gap = gap_ns;
+    status_count = 0;
+    bus_add_read(sla, rdata, rlen);
+    bus_add(OP_STOP, busy, rdata);
+
+    return bus_run();
+}
+
+
+uint16_t mock_i2c_read(uint8_t sla, uint8_t *rdata, uint16_t rlen)
+{
+    bus_add_read(sla, rdata, rlen);
+    bus_add(OP_STOP, 0, NULL);
+
+    return bus_run();
+}
+
+
+void mock_idle(uint64_t ns)
+{
+    if (app_started)
+    {
+        mock_now += ns;
+        return;
+    }
+
+    run_until = mock_now + ns;
+    swapcontext(&driver_ctx, &device_ctx);
+    run_until = 0;
+}
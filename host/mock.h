@@ -0,0 +1,116 @@
+/***************************************************************************
+ *   Host build of twiboot: simulated AVR peripherals                      *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; version 2 of the License,               *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ ***************************************************************************/
+#ifndef _MOCK_H_
+#define _MOCK_H_
+
+#include <stdint.h>
+
+/* simulated MCU @ 8MHz: atmega328p, or atmega1284p with MOCK_ATMEGA1284P */
+#define MOCK_CPU_HZ             8000000ULL
+#if defined (MOCK_ATMEGA1284P)
+#define MOCK_FLASH_SIZE         0x20000
+#define MOCK_EEPROM_SIZE        0x1000
+#define MOCK_PAGE_SIZE          256
+#else
+#define MOCK_FLASH_SIZE         0x8000
+#define MOCK_EEPROM_SIZE        0x400
+#define MOCK_PAGE_SIZE          128
+#endif
+
+/* timing model (ns) */
+#define MOCK_ACCESS_NS          500         /* every register access */
+#define MOCK_SPM_ERASE_NS       4500000     /* page erase, datasheet max. */
+#define MOCK_SPM_WRITE_NS       4500000     /* page write, datasheet max. */
+#define MOCK_EE_ATOMIC_NS       3400000     /* eeprom erase + write */
+#define MOCK_EE_ERASE_NS        1800000     /* eeprom erase only */
+#define MOCK_EE_WRITE_NS        1800000     /* eeprom write only */
+#define MOCK_POLL_GAP_NS        50000       /* master: delay between address polls */
+#define MOCK_SLEEP_STEP_NS      1000        /* resolution of idle sleep */
+#define MOCK_PULLUP_NS          5000        /* pin with pull-up enabled reads low until charged */
+
+/* register indices */
+enum {
+    MOCK_TWBR, MOCK_TWSR, MOCK_TWAR, MOCK_TWDR, MOCK_TWCR, MOCK_TWAMR,
+    MOCK_TCCR0B, MOCK_TCNT0, MOCK_TIFR0, MOCK_TIMSK0,
+    MOCK_EECR, MOCK_EEDR, MOCK_EEARL, MOCK_EEARH,
+    MOCK_DDRB, MOCK_PORTB, MOCK_PINB, MOCK_DDRC, MOCK_PORTC, MOCK_PINC,
+    MOCK_DDRD, MOCK_PORTD, MOCK_PIND,
+    MOCK_MCUSR, MOCK_MCUCR, MOCK_WDTCSR, MOCK_SMCR, MOCK_SPMCSR,
+    MOCK_GPIOR0, MOCK_RAMPZ, MOCK_SREG,
+    MOCK_REG_COUNT
+};
+
+/* interrupt vectors */
+enum {
+    MOCK_VECT_TIMER0_OVF, MOCK_VECT_TWI,
+    MOCK_VECT_COUNT
+};
+
+struct mock_stats
+{
+    uint64_t bus_bits;          /* bits clocked on the bus (incl. start/stop) */
+    uint32_t transactions;      /* addressed transactions (SLA+W / SLA+R) */
+    uint32_t data_bytes;        /* data bytes after the address */
+    uint32_t addr_polls;        /* SLA not acknowledged, master retried */
+    uint32_t data_nacks;        /* data byte NACKed, transaction aborted */
+    uint32_t status_polls;      /* status read again, slave busy */
+    uint64_t stretch_ns;        /* clock stretched by the slave */
+    uint64_t stop_busy_ns;      /* slave busy after STOP (address NACKed) */
+    uint32_t page_erases;
+    uint32_t page_writes;
+    uint64_t spm_busy_ns;
+    uint32_t ee_writes;
+    uint64_t ee_busy_ns;
+    uint32_t errors;            /* illegal SPM / EEPROM / RWW accesses */
+    uint64_t sleep_ns;          /* CPU in idle sleep */
+};
+
+extern uint64_t mock_now;
+extern uint32_t mock_bus_hz;
+extern struct mock_stats mock_stats;
+extern uint8_t mock_flash[MOCK_FLASH_SIZE];
+extern uint8_t mock_eeprom[MOCK_EEPROM_SIZE];
+extern uint8_t mock_regs[MOCK_REG_COUNT];
+
+/* register access from the firmware */
+volatile uint8_t *mock_access(uint8_t reg);
+
+/* SPM / flash access from the firmware */
+void mock_page_erase(uint32_t address);
+void mock_page_fill(uint32_t address, uint16_t data);
+void mock_page_write(uint32_t address);
+void mock_rww_enable(void);
+uint8_t mock_spm_busy(void);
+uint8_t mock_flash_read(uint32_t address);
+
+/* interrupts / sleep from the firmware */
+void mock_sei(void);
+void mock_cli(void);
+void mock_sleep(void);
+
+/* driver side */
+void mock_init(void (*entry)(void), uint32_t bootloader_start);
+void mock_set_vector(uint8_t vect, void (*isr)(void));
+void mock_app_start(void) __attribute__((noreturn));
+uint64_t mock_app_started(void);
+
+uint16_t mock_i2c_write(uint8_t sla, const uint8_t *data, uint16_t len);
+uint16_t mock_i2c_write_read(uint8_t sla, const uint8_t *wdata, uint16_t wlen,
+                             uint8_t *rdata, uint16_t rlen);
+uint16_t mock_i2c_read(uint8_t sla, uint8_t *rdata, uint16_t rlen);
+/* write, then read rlen status bytes every gap_ns until (rdata[0] & busy) == 0 */
+uint16_t mock_i2c_write_poll(uint8_t sla, const uint8_t *wdata, uint16_t wlen,
+                             uint8_t *rdata, uint16_t rlen, uint8_t busy, uint64_t gap_ns);
+void mock_idle(uint64_t ns);
+
+#endif /* _MOCK_H_ */
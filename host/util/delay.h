@@ -0,0 +1,15 @@
+/*
+ * Host build of twiboot: minimal <util/delay.h> replacement.
+ */
+#ifndef _MOCK_UTIL_DELAY_H_
+#define _MOCK_UTIL_DELAY_H_
+
+#include <stdint.h>
+#include "../mock.h"
+
+static inline void _delay_us(double us)
+{
+    mock_now += (uint64_t)(us * 1000);
+}
+
+#endif /* _MOCK_UTIL_DELAY_H_ */
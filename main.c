@@ -20,11 +20,121 @@
 #include <avr/interrupt.h>
 #include <avr/boot.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/crc16.h>
 
 #define VERSION_STRING      "TWIBOOT v3.0"
+
+/* compile time options, may be overridden on the command line */
+#ifndef EEPROM_SUPPORT
 #define EEPROM_SUPPORT      1
+#endif
+#ifndef LED_SUPPORT
 #define LED_SUPPORT         1
+#endif
+#ifndef USE_CLOCKSTRETCH
 #define USE_CLOCKSTRETCH    0
+#endif
+#ifndef FLASH_STREAM_SUPPORT
+#define FLASH_STREAM_SUPPORT 0
+#endif
+#ifndef SKIP_UNCHANGED_PAGES
+#define SKIP_UNCHANGED_PAGES 0
+#endif
+#ifndef CRC_SUPPORT
+#define CRC_SUPPORT         0
+#endif
+#ifndef FAST_BOOT
+#define FAST_BOOT           0
+#endif
+#ifndef BUS_IDLE_US
+#define BUS_IDLE_US         20
+#endif
+#ifndef GENERAL_CALL_SUPPORT
+#define GENERAL_CALL_SUPPORT 0
+#endif
+#ifndef FLASH_LZ_SUPPORT
+#define FLASH_LZ_SUPPORT    0
+#endif
+#ifndef USE_INTERRUPTS
+#define USE_INTERRUPTS      0
+#endif
+#ifndef ERASE_AHEAD
+#define ERASE_AHEAD         0
+#endif
+#ifndef ZERO_COPY_FLASH
+#define ZERO_COPY_FLASH     0
+#endif
+#ifndef EEPROM_SKIP_UNCHANGED
+#define EEPROM_SKIP_UNCHANGED 0
+#endif
+#ifndef EEPROM_STREAM_SUPPORT
+#define EEPROM_STREAM_SUPPORT 0
+#endif
+#ifndef BULK_ERASE_SUPPORT
+#define BULK_ERASE_SUPPORT  0
+#endif
+#ifndef FLASH_DELTA_SUPPORT
+#define FLASH_DELTA_SUPPORT 0
+#endif
+#ifndef PAGE_CRC_SUPPORT
+#define PAGE_CRC_SUPPORT    0
+#endif
+#ifndef STATUS_SUPPORT
+#define STATUS_SUPPORT      0
+#endif
+#ifndef DESCRIPTOR_SUPPORT
+#define DESCRIPTOR_SUPPORT  0
+#endif
+#ifndef JOURNAL_SUPPORT
+#define JOURNAL_SUPPORT     0
+#endif
+#ifndef JOURNAL_INTERVAL
+#define JOURNAL_INTERVAL    8
+#endif
+#ifndef SERVICE_TABLE_SUPPORT
+#define SERVICE_TABLE_SUPPORT 0
+#endif
+#ifndef STAGED_UPDATE_SUPPORT
+#define STAGED_UPDATE_SUPPORT 0
+#endif
+#ifndef ADDRESS_ASSIGN_SUPPORT
+#define ADDRESS_ASSIGN_SUPPORT 0
+#endif
+#ifndef ADDRESS_STRAP_PINS
+#define ADDRESS_STRAP_PINS  0
+#endif
+#ifndef GROUP_ADDRESS_SUPPORT
+#define GROUP_ADDRESS_SUPPORT 0
+#endif
+
+#if (FLASH_DELTA_SUPPORT) && ((ERASE_AHEAD) || (ZERO_COPY_FLASH))
+#error "FLASH_DELTA_SUPPORT reads flash while receiving, can not be combined with ERASE_AHEAD or ZERO_COPY_FLASH"
+#endif
+
+#if (EEPROM_STREAM_SUPPORT) && !(EEPROM_SUPPORT)
+#error "EEPROM_STREAM_SUPPORT requires EEPROM_SUPPORT"
+#endif
+
+#if (JOURNAL_SUPPORT) && !(EEPROM_SUPPORT)
+#error "JOURNAL_SUPPORT requires EEPROM_SUPPORT"
+#endif
+
+#if (ADDRESS_ASSIGN_SUPPORT) && !(EEPROM_SUPPORT)
+#error "ADDRESS_ASSIGN_SUPPORT requires EEPROM_SUPPORT"
+#endif
+
+#if (ADDRESS_STRAP_PINS > 3)
+#error "ADDRESS_STRAP_PINS out of range"
+#endif
+
+#if (GROUP_ADDRESS_SUPPORT) && !defined (TWAMR)
+#error "GROUP_ADDRESS_SUPPORT requires TWAMR (atmega88/168/328p/644p/1284p/2560)"
+#endif
+
+#if (ZERO_COPY_FLASH) && ((FLASH_STREAM_SUPPORT) || (FLASH_LZ_SUPPORT) || (ERASE_AHEAD))
+#error "ZERO_COPY_FLASH can not be combined with FLASH_STREAM_SUPPORT, FLASH_LZ_SUPPORT or ERASE_AHEAD"
+#endif
 
 #define F_CPU               8000000ULL
 #define TIMER_DIVISOR       1024
@@ -56,16 +166,141 @@
 #define TWI_ADDRESS         0x29
 #endif
 
+#if (ADDRESS_STRAP_PINS)
+#include <util/delay.h>
+
+/* strap pins from PD2 on (internal pull-ups), a jumper to GND adds 1<<n */
+#define STRAP_SETTLE_US     10
+#define STRAP_MASK          (((1<<ADDRESS_STRAP_PINS) -1) << PORTD2)
+#define STRAP_INIT()        PORTD |= STRAP_MASK
+#define STRAP_READ()        ((~PIND & STRAP_MASK) >> PORTD2)
+#define STRAP_OFF()         PORTD &= ~STRAP_MASK
+#endif /* (ADDRESS_STRAP_PINS) */
+
+/* group address (GROUP_ADDRESS_SUPPORT), 0x00: none */
+#ifndef TWI_GROUP_ADDRESS
+#define TWI_GROUP_ADDRESS   0x00
+#endif
+
+/* valid 7bit addresses, without reserved ones */
+#define ADDRESS_MIN         0x08
+#define ADDRESS_MAX         0x77
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+/* assigned slave / group address, below the journal at the end of the eeprom */
+#define ADDRESS_EEPROM_ADDR (E2END +1 - 5)
+#define GROUP_EEPROM_ADDR   (E2END +1 - 6)
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+/* eeprom end kept for journal / assigned addresses: not reported, not writable by the master */
+#if (ADDRESS_ASSIGN_SUPPORT) && (GROUP_ADDRESS_SUPPORT)
+#define EEPROM_RESERVED     6
+#elif (ADDRESS_ASSIGN_SUPPORT)
+#define EEPROM_RESERVED     5
+#elif (JOURNAL_SUPPORT)
+#define EEPROM_RESERVED     4
+#else
+#define EEPROM_RESERVED     0
+#endif
+#define EEPROM_SIZE         (E2END +1 - EEPROM_RESERVED)
+
+/* page offsets: 256 byte pages do not fit into 8 bits */
+#if (SPM_PAGESIZE > 128)
+typedef uint16_t pos_t;
+#else
+typedef uint8_t pos_t;
+#endif
+
+/* flash addresses: devices with more than 64kB flash use 3 address bytes */
+#if (FLASHEND > 0xFFFF)
+typedef uint32_t addr_t;
+#define ADDR_BYTES          3
+#define read_flash_byte(x)  pgm_read_byte_far(x)
+#define read_flash_word(x)  pgm_read_word_far(x)
+#else
+typedef uint16_t addr_t;
+#define ADDR_BYTES          2
+#define read_flash_byte(x)  pgm_read_byte_near(x)
+#define read_flash_word(x)  pgm_read_word_near(x)
+#endif
+
+/* first data byte of CMD_ACCESS_MEMORY: cmd, memtype, address */
+#define DATA_START          (2 + ADDR_BYTES)
+
+#if (BUS_IDLE_US)
+/* TWI pins, sampled before starting the application */
+#if defined (__AVR_ATmega8__) || defined (__AVR_ATmega88__) || \
+    defined (__AVR_ATmega168__) || defined (__AVR_ATmega328P__)
+#define TWI_PIN             PINC
+#define TWI_SDA             PINC4
+#define TWI_SCL             PINC5
+#elif defined (__AVR_ATmega644P__) || defined (__AVR_ATmega1284P__)
+#define TWI_PIN             PINC
+#define TWI_SDA             PINC1
+#define TWI_SCL             PINC0
+#elif defined (__AVR_ATmega2560__)
+#define TWI_PIN             PIND
+#define TWI_SDA             PIND1
+#define TWI_SCL             PIND0
+#else
+#error "TWI pins not defined"
+#endif
+
+/* wait_bus_idle(): about 8 cycles per loop */
+#define BUS_IDLE_LOOPS      ((BUS_IDLE_US * F_CPU) / (8 * 1000000ULL))
+#if (BUS_IDLE_LOOPS < 1) || (BUS_IDLE_LOOPS > 255)
+#error "BUS_IDLE_US out of range"
+#endif
+#endif /* (BUS_IDLE_US) */
+
+#if (STAGED_UPDATE_SUPPORT)
+/* application and staged image share the flash below the bootloader,
+ * the last page holds the header of the staged image
+ */
+#define STAGE_HEADER        (BOOTLOADER_START - SPM_PAGESIZE)
+#define STAGE_START         ((STAGE_HEADER / 2) & ~(SPM_PAGESIZE -1))
+#define STAGE_PAGES         (STAGE_START / SPM_PAGESIZE)
+#define STAGE_MAGIC         0x5AA5
+#define APP_END             STAGE_START
+#else
+#define APP_END             BOOTLOADER_START
+#endif /* (STAGED_UPDATE_SUPPORT) */
+
+#if (FAST_BOOT)
+/* valid application marker in the last word of the application section */
+#define APP_MAGIC_ADDR      (APP_END - 2)
+#define APP_MAGIC_PAGE      (APP_END - SPM_PAGESIZE)
+#define APP_MAGIC           0x5AA5
+#endif /* (FAST_BOOT) */
+
 /* SLA+R */
 #define CMD_WAIT                0x00
 #define CMD_READ_VERSION        0x01
 #define CMD_ACCESS_MEMORY       0x02
 /* internal mappings */
+#define CMD_READ_STATUS         (0x10 | CMD_WAIT)
 #define CMD_ACCESS_CHIPINFO     (0x10 | CMD_ACCESS_MEMORY)
 #define CMD_ACCESS_FLASH        (0x20 | CMD_ACCESS_MEMORY)
 #define CMD_ACCESS_EEPROM       (0x30 | CMD_ACCESS_MEMORY)
 #define CMD_WRITE_FLASH_PAGE    (0x40 | CMD_ACCESS_MEMORY)
 #define CMD_WRITE_EEPROM_PAGE   (0x50 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_STREAM       (0x60 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_CRC          (0x70 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_FLASH_CRC    (0x80 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_EEPROM_CRC   (0x90 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_FLASH_LZ     (0xA0 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_EEPROM_STREAM (0xB0 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_ERASE        (0xC0 | CMD_ACCESS_MEMORY)
+#define CMD_ERASE_FLASH         (0xD0 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_FLASH_DELTA  (0xE0 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_PAGE_CRC     (0xF0 | CMD_ACCESS_MEMORY)
+/* internal mappings, second bank (all CMD_ACCESS_MEMORY slots used) */
+#define CMD_ACCESS_MEMORY2      (0x04 | CMD_ACCESS_MEMORY)
+#define CMD_ACCESS_DESCRIPTOR   (0x10 | CMD_ACCESS_MEMORY2)
+#define CMD_ACCESS_JOURNAL      (0x20 | CMD_ACCESS_MEMORY2)
+#define CMD_START_JOURNAL       (0x30 | CMD_ACCESS_MEMORY2)
+#define CMD_ACCESS_ADDRESS      (0x40 | CMD_ACCESS_MEMORY2)
+#define CMD_ASSIGN_ADDRESS      (0x50 | CMD_ACCESS_MEMORY2)
 
 /* SLA+W */
 #define CMD_SWITCH_APPLICATION  CMD_READ_VERSION
@@ -81,6 +316,17 @@
 #define MEMTYPE_CHIPINFO        0x00
 #define MEMTYPE_FLASH           0x01
 #define MEMTYPE_EEPROM          0x02
+#define MEMTYPE_FLASH_STREAM    0x03
+#define MEMTYPE_FLASH_LZ        0x04
+#define MEMTYPE_EEPROM_STREAM   0x05
+#define MEMTYPE_FLASH_ERASE     0x06
+#define MEMTYPE_FLASH_DELTA     0x07
+#define MEMTYPE_FLASH_CRC       0x81
+#define MEMTYPE_EEPROM_CRC      0x82
+#define MEMTYPE_PAGE_CRC        0x83
+#define MEMTYPE_DESCRIPTOR      0x84
+#define MEMTYPE_JOURNAL         0x85
+#define MEMTYPE_ADDRESS         0x86
 
 /*
  * LED_GN flashes with 20Hz (while bootloader is running)
@@ -98,6 +344,8 @@
  *
  * - read chip info: 3byte signature, 1byte page size, 2byte flash size, 2byte eeprom size
  *   SLA+W, 0x02, 0x00, 0x00, 0x00, SLA+R, {8 bytes}, STO
+ *   (page size 0x00: 256 bytes, devices with more than 64kB flash append
+ *   the upper flash size byte: {9 bytes})
  *
  * - read one (or more) flash bytes
  *   SLA+W, 0x02, 0x01, addrh, addrl, SLA+R, {* bytes}, STO
@@ -110,198 +358,1680 @@
  *
  * - write one (or more) eeprom bytes
  *   SLA+W, 0x02, 0x02, addrh, addrl, {* bytes}, STO
+ *
+ * - write one (or more) consecutive flash pages (FLASH_STREAM_SUPPORT)
+ *   SLA+W, 0x02, 0x03, addrh, addrl, {n * pagesize bytes}, STO
+ *
+ * - write one compressed flash page (FLASH_LZ_SUPPORT)
+ *   SLA+W, 0x02, 0x04, addrh, addrl, {* bytes}, STO
+ *   tokens until the page is complete:
+ *   0x00-0x7F: (token +1) literal bytes follow
+ *   0x80-0xFF, dist: copy ((token & 0x7F) +2) bytes from (dist +1) bytes back
+ *
+ * - write one flash page as delta of the current flash (FLASH_DELTA_SUPPORT)
+ *   SLA+W, 0x02, 0x07, addrh, addrl, {* bytes}, STO
+ *   tokens until the page is complete:
+ *   0x00-0x7F: (token +1) literal bytes follow
+ *   0x80-0xFF, srch, srcl: copy ((token & 0x7F) +1) bytes from flash address src
+ *   (three source address bytes on devices with more than 64kB flash)
+ *
+ * - write consecutive eeprom bytes, programmed while receiving (EEPROM_STREAM_SUPPORT)
+ *   SLA+W, 0x02, 0x05, addrh, addrl, {* bytes}, STO
+ *
+ * - erase a range of flash pages (BULK_ERASE_SUPPORT, 0 pages: up to the bootloader)
+ *   SLA+W, 0x02, 0x06, addrh, addrl, pagesh, pagesl, STO
+ *
+ * - calculate crc16 of a flash / eeprom range (CRC_SUPPORT)
+ *   SLA+W, 0x02, 0x81, addrh, addrl, lenh, lenl, STO
+ *   SLA+W, 0x02, 0x82, addrh, addrl, lenh, lenl, STO
+ *
+ * - read calculated crc16 (CRC-16/CCITT-FALSE), not calculated if a length byte is missing
+ *   SLA+R, {2 bytes}, STO
+ *   while busy the SLA+R is NACKed, with STATUS_SUPPORT it is ACKed and the clock
+ *   is stretched until the crc is ready
+ *
+ * - read crc16 of consecutive flash pages, starting at a page boundary (PAGE_CRC_SUPPORT)
+ *   SLA+W, 0x02, 0x83, addrh, addrl, SLA+R, {n * 2 bytes}, STO
+ *
+ * - read status while busy and after a write (STATUS_SUPPORT)
+ *   SLA+R, {status, pagesh, pagesl}, STO
+ *   status: 0x80 busy, 0x02 incomplete page or crc length, 0x01 address not writeable
+ *   pages: flash pages written since start (or already identical)
+ *
+ * - read capability descriptor (DESCRIPTOR_SUPPORT)
+ *   SLA+W, 0x02, 0x84, 0x00, 0x00, SLA+R, {12 bytes}, STO
+ *   protocol version, descriptor length, 4byte feature bits, 2byte max. data
+ *   bytes of a write transaction, address bytes, page erase / page write /
+ *   eeprom byte time (100us units, datasheet max.)
+ *
+ * - start progress journal of an image / read committed progress (JOURNAL_SUPPORT)
+ *   SLA+W, 0x02, 0x85, 0x00, 0x00, idh, idl, STO
+ *   SLA+W, 0x02, 0x85, 0x00, 0x00, SLA+R, {idh, idl, pagesh, pagesl}, STO
+ *   pages: consecutive flash pages from address 0 committed for image id
+ *
+ * - assign slave address, stored in the eeprom (ADDRESS_ASSIGN_SUPPORT)
+ *   SLA+W, 0x02, 0x86, 0x00, 0x00, addr, ~addr, STO
+ *   addr 0x08 - 0x77, used after the STOP; 0xFF clears the assignment
+ *   no device selector: only one device may answer the current address
+ *
+ * - assign group address (ADDRESS_ASSIGN_SUPPORT and GROUP_ADDRESS_SUPPORT)
+ *   SLA+W, 0x02, 0x86, 0x00, 0x01, addr, ~addr, STO
+ *   addr 0x08 - 0x77, 0x00 no group, 0xFF clears the assignment
+ *   SLA+R to a masked (group) address: 0xFF, no data (all members answer)
+ *
+ * FAST_BOOT: the application is started without timeout if the last two
+ * bytes of the application section are 0xA5, 0x5A and the reset was not
+ * caused by the watchdog (application requests the bootloader by watchdog
+ * reset). The first flash write clears the marker word (not the page), the
+ * master writes the marker again as the last step of an update.
+ *
+ * Devices with more than 64kB flash (atmega1284p, atmega2560) use three
+ * address bytes (addrx, addrh, addrl) for all memory types, the data
+ * follows one byte later.
+ *
+ * GENERAL_CALL_SUPPORT: SLA+W commands are also accepted via general call
+ * (address 0x00), all listening bootloaders write the same pages. Unknown
+ * command bytes (general call reset 0x06, ...) are NACKed, not booting.
+ *
+ * STATUS_SUPPORT: the slave address stays acknowledged while a write is done
+ * after the Stop Condition. SLA+R returns the status, data bytes of SLA+W
+ * are NACKed until the write is complete.
+ *
+ * JOURNAL_SUPPORT: the last 4 bytes of the eeprom hold image id and committed
+ * pages, updated every JOURNAL_INTERVAL pages. The first flash write of a
+ * session without a started journal clears the committed pages.
+ *
+ * SERVICE_TABLE_SUPPORT: the last 8 bytes of the flash hold rjmp entries to
+ * page erase / page fill / page write / eeprom write for the application
+ * (self-programming while running, see service_table).
+ *
+ * STAGED_UPDATE_SUPPORT: the application is limited to the lower half of the
+ * flash below the bootloader, a new image is written to the upper half and
+ * a header (pages, crc16, magic) to the last page. After reset the staged
+ * image is verified and copied into place, an interrupted copy resumes.
+ *
+ * Slave address: assigned address from the eeprom (ADDRESS_ASSIGN_SUPPORT),
+ * else TWI_ADDRESS plus the jumpered strap pins (ADDRESS_STRAP_PINS).
+ *
+ * GROUP_ADDRESS_SUPPORT: TWAMR masks the bits in which slave and group
+ * address differ, SLA+W to the group address writes into all members.
+ * The device also answers the addresses in between, an address plan
+ * keeps them unused (e.g. group 0x40, members 0x41, 0x42, 0x44, ...).
  */
 
 const static uint8_t info[16] = VERSION_STRING;
-const static uint8_t chipinfo[8] = {
+const static uint8_t chipinfo[] = {
     SIGNATURE_0, SIGNATURE_1, SIGNATURE_2,
-    SPM_PAGESIZE,
+    SPM_PAGESIZE & 0xFF,
 
     (BOOTLOADER_START >> 8) & 0xFF,
     BOOTLOADER_START & 0xFF,
 
 #if (EEPROM_SUPPORT)
-    ((E2END +1) >> 8 & 0xFF),
-    (E2END +1) & 0xFF
+    (EEPROM_SIZE >> 8) & 0xFF,
+    EEPROM_SIZE & 0xFF,
+#else
+    0x00, 0x00,
+#endif
+
+#if (ADDR_BYTES > 2)
+    (BOOTLOADER_START >> 16) & 0xFF,
+#endif
+};
+
+#if (DESCRIPTOR_SUPPORT)
+#define PROTOCOL_VERSION        0x03
+
+/* optional features, bits of the descriptor */
+#define FEATURE_EEPROM          0x00000001UL    /* EEPROM_SUPPORT */
+#define FEATURE_FLASH_STREAM    0x00000002UL    /* memtype 0x03 */
+#define FEATURE_FLASH_LZ        0x00000004UL    /* memtype 0x04 */
+#define FEATURE_EEPROM_STREAM   0x00000008UL    /* memtype 0x05 */
+#define FEATURE_BULK_ERASE      0x00000010UL    /* memtype 0x06 */
+#define FEATURE_FLASH_DELTA     0x00000020UL    /* memtype 0x07 */
+#define FEATURE_CRC             0x00000040UL    /* memtype 0x81 / 0x82 */
+#define FEATURE_PAGE_CRC        0x00000080UL    /* memtype 0x83 */
+#define FEATURE_STATUS          0x00000100UL    /* status read while busy */
+#define FEATURE_GENERAL_CALL    0x00000200UL
+#define FEATURE_CLOCKSTRETCH    0x00000400UL    /* writes while receiving, no address NACK */
+#define FEATURE_SKIP_UNCHANGED  0x00000800UL    /* flash pages */
+#define FEATURE_EEPROM_SKIP     0x00001000UL
+#define FEATURE_ERASE_AHEAD     0x00002000UL
+#define FEATURE_FAST_BOOT       0x00004000UL
+#define FEATURE_JOURNAL         0x00008000UL    /* memtype 0x85 */
+#define FEATURE_SERVICE_TABLE   0x00010000UL    /* application entry points */
+#define FEATURE_STAGED_UPDATE   0x00020000UL    /* staged image copied on boot */
+#define FEATURE_ADDRESS_ASSIGN  0x00040000UL    /* memtype 0x86 */
+#define FEATURE_GROUP_ADDRESS   0x00080000UL    /* TWAMR */
+
+#define DESCRIPTOR_FEATURES ( \
+    ((EEPROM_SUPPORT) ? FEATURE_EEPROM : 0) | \
+    ((FLASH_STREAM_SUPPORT) ? FEATURE_FLASH_STREAM : 0) | \
+    ((FLASH_LZ_SUPPORT) ? FEATURE_FLASH_LZ : 0) | \
+    ((EEPROM_STREAM_SUPPORT) ? FEATURE_EEPROM_STREAM : 0) | \
+    ((BULK_ERASE_SUPPORT) ? FEATURE_BULK_ERASE : 0) | \
+    ((FLASH_DELTA_SUPPORT) ? FEATURE_FLASH_DELTA : 0) | \
+    ((CRC_SUPPORT) ? FEATURE_CRC : 0) | \
+    ((PAGE_CRC_SUPPORT) ? FEATURE_PAGE_CRC : 0) | \
+    ((STATUS_SUPPORT) ? FEATURE_STATUS : 0) | \
+    ((GENERAL_CALL_SUPPORT) ? FEATURE_GENERAL_CALL : 0) | \
+    ((USE_CLOCKSTRETCH) ? FEATURE_CLOCKSTRETCH : 0) | \
+    ((SKIP_UNCHANGED_PAGES) ? FEATURE_SKIP_UNCHANGED : 0) | \
+    ((EEPROM_SKIP_UNCHANGED) ? FEATURE_EEPROM_SKIP : 0) | \
+    ((ERASE_AHEAD) ? FEATURE_ERASE_AHEAD : 0) | \
+    ((FAST_BOOT) ? FEATURE_FAST_BOOT : 0) | \
+    ((JOURNAL_SUPPORT) ? FEATURE_JOURNAL : 0) | \
+    ((SERVICE_TABLE_SUPPORT) ? FEATURE_SERVICE_TABLE : 0) | \
+    ((STAGED_UPDATE_SUPPORT) ? FEATURE_STAGED_UPDATE : 0) | \
+    ((ADDRESS_ASSIGN_SUPPORT) ? FEATURE_ADDRESS_ASSIGN : 0) | \
+    ((GROUP_ADDRESS_SUPPORT) ? FEATURE_GROUP_ADDRESS : 0))
+
+/* programming times in 100us units, datasheet max. (tWD_FLASH, tWD_EEPROM) */
+#define PAGE_ERASE_TIME         45
+#define PAGE_WRITE_TIME         45
+#if defined (__AVR_ATmega8__)
+#define EEPROM_BYTE_TIME        85
 #else
-    0x00, 0x00
+#define EEPROM_BYTE_TIME        34
 #endif
+
+const static uint8_t descriptor[] = {
+    PROTOCOL_VERSION,
+    12,
+
+    (DESCRIPTOR_FEATURES >> 24) & 0xFF,
+    (DESCRIPTOR_FEATURES >> 16) & 0xFF,
+    (DESCRIPTOR_FEATURES >> 8) & 0xFF,
+    DESCRIPTOR_FEATURES & 0xFF,
+
+    /* page buffer, streaming memtypes have no limit */
+    (SPM_PAGESIZE >> 8) & 0xFF,
+    SPM_PAGESIZE & 0xFF,
+
+    ADDR_BYTES,
+    PAGE_ERASE_TIME,
+    PAGE_WRITE_TIME,
+    EEPROM_BYTE_TIME,
 };
+#endif /* (DESCRIPTOR_SUPPORT) */
 
 static uint8_t boot_timeout = TIMER_MSEC2IRQCNT(TIMEOUT_MS);
 static uint8_t cmd = CMD_WAIT;
 
-/* flash buffer */
+#if (GENERAL_CALL_SUPPORT)
+/* current write was addressed by general call */
+static uint8_t general_call;
+#endif /* (GENERAL_CALL_SUPPORT) */
+
+/* flash buffer (ZERO_COPY_FLASH: eeprom only, EEPROM_STREAM_SUPPORT: ring buffer) */
+#if !(ZERO_COPY_FLASH) || ((EEPROM_SUPPORT) && (USE_CLOCKSTRETCH == 0)) || (EEPROM_STREAM_SUPPORT)
 static uint8_t buf[SPM_PAGESIZE];
-static uint16_t addr;
+#endif
+static addr_t addr;
+
+#if (CRC_SUPPORT) || (PAGE_CRC_SUPPORT)
+/* crc range length, result after calculation */
+static uint16_t crc;
+#endif /* (CRC_SUPPORT) || (PAGE_CRC_SUPPORT) */
+
+/* byte counter of the current TWI transaction */
+static pos_t bcnt;
+
+#if (FAST_BOOT)
+static uint8_t app_valid;
+#endif /* (FAST_BOOT) */
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+/* received address and complement */
+static uint16_t new_address;
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+#if (ERASE_AHEAD)
+#define PAGE_ERASE              0x01    /* erase of the target page started */
+#define PAGE_CHANGED            0x02    /* received data differs from flash */
+
+static uint8_t page_state;
+#endif /* (ERASE_AHEAD) */
+
+#if (ZERO_COPY_FLASH)
+/* low byte of the next page buffer word */
+static uint8_t fill_low;
+#endif /* (ZERO_COPY_FLASH) */
+
+#if (FLASH_STREAM_SUPPORT)
+#define SPM_IDLE                0x00
+#define SPM_ERASE               0x01
+#define SPM_WRITE               0x02
+
+/* second flash buffer, one page is received while the other is written */
+static uint8_t stream_buf[SPM_PAGESIZE];
+static uint8_t *rx_buf = buf;
+static uint8_t *spm_buf;
+static addr_t spm_addr;
+static uint8_t spm_state = SPM_IDLE;
+#endif /* (FLASH_STREAM_SUPPORT) */
+
+#if (FLASH_LZ_SUPPORT)
+#define LZ_TOKEN                0x00
+#define LZ_LITERAL              0x01
+#define LZ_DISTANCE             0x02
+
+/* decoder state of a compressed page */
+static pos_t lz_pos;
+static uint8_t lz_len;
+static uint8_t lz_state;
+#endif /* (FLASH_LZ_SUPPORT) */
+
+#if (FLASH_DELTA_SUPPORT)
+#define DELTA_TOKEN             0x00
+#define DELTA_LITERAL           0x01
+#define DELTA_SOURCE            0x02    /* + remaining source address bytes */
+
+/* decoder state of a delta page */
+static pos_t delta_pos;
+static uint8_t delta_len;
+static uint8_t delta_state;
+static addr_t delta_src;
+#endif /* (FLASH_DELTA_SUPPORT) */
+
+#if (BULK_ERASE_SUPPORT)
+/* pages erased by the bulk erase and not written since */
+#define BLANK_PAGES             (BOOTLOADER_START / SPM_PAGESIZE)
+
+static uint8_t blank_map[(BLANK_PAGES + 7) / 8];
+static uint16_t erase_pages;
+#endif /* (BULK_ERASE_SUPPORT) */
+
+#if (EEPROM_STREAM_SUPPORT)
+/* eeprom ring buffer in buf[], free running counters */
+static pos_t ee_head;
+static pos_t ee_tail;
+#endif /* (EEPROM_STREAM_SUPPORT) */
+
+#if (JOURNAL_SUPPORT)
+/* eeprom layout: idh, idl, pagesh, pagesl */
+#define JOURNAL_SIZE            4
+#define JOURNAL_ADDR            (E2END +1 - JOURNAL_SIZE)
+#define JOURNAL_PAGES_ADDR      (JOURNAL_ADDR +2)
+#define JOURNAL_MAX_PAGES       (BOOTLOADER_START / SPM_PAGESIZE)
+
+#define JOURNAL_UNKNOWN         0x00    /* no flash write in this session yet */
+#define JOURNAL_IDLE            0x01    /* committed pages cleared, not tracking */
+#define JOURNAL_ACTIVE          0x02    /* started, tracking committed pages */
+
+static uint8_t journal_state;
+static uint16_t journal_id;
+static uint16_t journal_pages;
+
+static void journal_invalidate(addr_t address);
+static void journal_page(addr_t pagestart);
+#if (BULK_ERASE_SUPPORT)
+static void journal_truncate(addr_t pagestart);
+#endif /* (BULK_ERASE_SUPPORT) */
+#endif /* (JOURNAL_SUPPORT) */
+
+#if (STATUS_SUPPORT)
+#define STATUS_ERR_ADDRESS      0x01    /* write outside of the application section / reserved eeprom, invalid slave address */
+#define STATUS_ERR_LENGTH       0x02    /* incomplete flash page / crc length, not written / calculated */
+#define STATUS_XFER             0x40    /* status read / SLA+W open while busy (internal) */
+#define STATUS_BUSY             0x80    /* write after STOP in progress */
+
+static uint8_t status;
+static uint8_t status_pos;
+static uint16_t status_pages;
+
+static void TWI_busy_poll(void);
+
+/* answer status reads while waiting */
+#define spm_busy_wait()         do { TWI_busy_poll(); } while (boot_spm_busy())
+#define ee_busy_wait()          do { TWI_busy_poll(); } while (!eeprom_is_ready())
+#else
+#define spm_busy_wait()         boot_spm_busy_wait()
+#define ee_busy_wait()          eeprom_busy_wait()
+#endif /* (STATUS_SUPPORT) */
 
+#if (FAST_BOOT)
 /* *************************************************************************
- * write_flash_page
+ * invalidate_app
  * ************************************************************************* */
-static void write_flash_page(void)
+static void invalidate_app(addr_t address)
 {
-    uint16_t pagestart = addr;
-    uint8_t size = SPM_PAGESIZE;
-    uint8_t *p = buf;
-
-    if (pagestart < BOOTLOADER_START)
+#if (STAGED_UPDATE_SUPPORT)
+    /* staged image: the running application stays valid */
+    if (address >= STAGE_START)
     {
-        boot_page_erase(pagestart);
-        boot_spm_busy_wait();
-
-        do {
-            uint16_t data = *p++;
-            data |= *p++ << 8;
-            boot_page_fill(addr, data);
+        return;
+    }
+#endif /* (STAGED_UPDATE_SUPPORT) */
 
-            addr += 2;
-            size -= 2;
-        } while (size);
+    if (app_valid)
+    {
+        app_valid = 0;
 
-        boot_page_write(pagestart);
-        boot_spm_busy_wait();
+        /* clear only the marker word: a page write without erase can only
+         * clear bits, the application code in the page is kept
+         */
+        spm_busy_wait();
+        boot_rww_enable();
+        boot_page_fill(APP_MAGIC_ADDR, 0x0000);
+        boot_page_write(APP_MAGIC_PAGE);
+        spm_busy_wait();
         boot_rww_enable();
     }
-} /* write_flash_page */
+} /* invalidate_app */
+#endif /* (FAST_BOOT) */
 
 
-#if (EEPROM_SUPPORT)
+#if (BULK_ERASE_SUPPORT)
 /* *************************************************************************
- * read_eeprom_byte
+ * take_blank_page
  * ************************************************************************* */
-static uint8_t read_eeprom_byte(uint16_t address)
+static uint8_t take_blank_page(addr_t pagestart)
 {
-    EEARL = address;
-    EEARH = (address >> 8);
-    EECR |= (1<<EERE);
+    uint16_t page = pagestart / SPM_PAGESIZE;
+    uint8_t mask = (1 << (page & 0x07));
+    uint8_t blank = blank_map[page >> 3] & mask;
 
-    return EEDR;
-} /* read_eeprom_byte */
+    /* page gets written, no longer blank */
+    blank_map[page >> 3] &= ~mask;
+
+    return blank;
+} /* take_blank_page */
+#endif /* (BULK_ERASE_SUPPORT) */
 
 
+#if (SKIP_UNCHANGED_PAGES)
+#define FLASH_PAGE_IDENTICAL    0x01
+#define FLASH_PAGE_BLANK        0x02
+
+#if (ZERO_COPY_FLASH)
+/* compare result of the page in the page buffer */
+static uint8_t page_cmp;
+#endif /* (ZERO_COPY_FLASH) */
+#endif /* (SKIP_UNCHANGED_PAGES) */
+
+/* ERASE_AHEAD / ZERO_COPY_FLASH: pages are compared while receiving */
+#if (SKIP_UNCHANGED_PAGES) && \
+    ((FLASH_STREAM_SUPPORT) || (!(ERASE_AHEAD) && !(ZERO_COPY_FLASH)))
+
 /* *************************************************************************
- * write_eeprom_byte
+ * compare_flash_page
  * ************************************************************************* */
-static void write_eeprom_byte(uint8_t val)
+static uint8_t compare_flash_page(addr_t pagestart, uint8_t *p)
 {
-    EEARL = addr;
-    EEARH = (addr >> 8);
-    EEDR = val;
-    addr++;
+    uint8_t state = (FLASH_PAGE_IDENTICAL | FLASH_PAGE_BLANK);
+    pos_t size = SPM_PAGESIZE;
 
-#if defined (EEWE)
-    EECR |= (1<<EEMWE);
-    EECR |= (1<<EEWE);
-#elif defined (EEPE)
-    EECR |= (1<<EEMPE);
-    EECR |= (1<<EEPE);
-#else
-#error "EEWE/EEPE not defined"
-#endif
+    do {
+        uint8_t data = read_flash_byte(pagestart++);
 
-    eeprom_busy_wait();
-} /* write_eeprom_byte */
+        if (data != *p++)
+        {
+            state &= ~(FLASH_PAGE_IDENTICAL);
+        }
+
+        if (data != 0xFF)
+        {
+            state &= ~(FLASH_PAGE_BLANK);
+        }
+    } while (--size);
 
+    return state;
+} /* compare_flash_page */
+#endif /* (SKIP_UNCHANGED_PAGES) */
 
-#if (USE_CLOCKSTRETCH == 0)
+
+#if (ERASE_AHEAD)
 /* *************************************************************************
- * write_eeprom_buffer
+ * erase_ahead
  * ************************************************************************* */
-static void write_eeprom_buffer(uint8_t size)
+static void erase_ahead(pos_t pos, uint8_t data)
 {
-    uint8_t *p = buf;
+    if ((page_state & PAGE_ERASE) || (addr >= BOOTLOADER_START))
+    {
+        return;
+    }
 
-    while (size--)
+    /* before the first compare: an unchanged marker page is not skipped */
+    if (pos == 0)
     {
-        write_eeprom_byte(*p++);
+#if (FAST_BOOT)
+        invalidate_app(addr);
+#endif /* (FAST_BOOT) */
+#if (JOURNAL_SUPPORT)
+        journal_invalidate(addr);
+#endif /* (JOURNAL_SUPPORT) */
     }
-} /* write_eeprom_buffer */
-#endif /* (USE_CLOCKSTRETCH == 0) */
-#endif /* EEPROM_SUPPORT */
 
+#if (SKIP_UNCHANGED_PAGES)
+    {
+        uint8_t old = read_flash_byte(addr + pos);
+
+        if (old == data)
+        {
+            return;
+        }
+
+        page_state |= PAGE_CHANGED;
+
+        /* programming can only clear bits */
+        if ((old & data) == data)
+        {
+            return;
+        }
+    }
+#endif /* (SKIP_UNCHANGED_PAGES) */
+
+#if (BULK_ERASE_SUPPORT)
+    /* erased by the bulk erase, page write only */
+    if (take_blank_page(addr))
+    {
+        page_state |= PAGE_ERASE;
+        return;
+    }
+#endif /* (BULK_ERASE_SUPPORT) */
 
+    /* RWW section: erase runs while the remaining bytes are received */
+    boot_page_erase(addr);
+    page_state |= PAGE_ERASE;
+} /* erase_ahead */
+#endif /* (ERASE_AHEAD) */
+
+
+#if (ZERO_COPY_FLASH)
 /* *************************************************************************
- * TWI_data_write
+ * fill_flash_byte
  * ************************************************************************* */
-static uint8_t TWI_data_write(uint8_t bcnt, uint8_t data)
+static void fill_flash_byte(pos_t pos, uint8_t data)
 {
-    uint8_t ack = 0x01;
-
-    switch (bcnt)
+    if (pos == 0)
     {
-        case 0:
-            switch (data)
-            {
-                case CMD_SWITCH_APPLICATION:
-                case CMD_ACCESS_MEMORY:
-                    /* no break */
+#if (FAST_BOOT)
+        /* re-enables the RWW section: before the page buffer is filled */
+        if (addr < BOOTLOADER_START)
+        {
+            invalidate_app(addr);
+        }
+#endif /* (FAST_BOOT) */
+#if (JOURNAL_SUPPORT)
+        /* eeprom write blocks SPM: before the page buffer is filled */
+        if (addr < BOOTLOADER_START)
+        {
+            journal_invalidate(addr);
+        }
+#endif /* (JOURNAL_SUPPORT) */
 
-                case CMD_WAIT:
-                    /* abort countdown */
-                    boot_timeout = 0;
-                    cmd = data;
-                    break;
+        /* clear the page buffer, an aborted page write may have left data */
+        boot_rww_enable();
 
-                default:
-                    /* boot app now */
-                    cmd = CMD_BOOT_APPLICATION;
-                    ack = 0x00;
-                    break;
-            }
-            break;
+#if (SKIP_UNCHANGED_PAGES)
+        page_cmp = (FLASH_PAGE_IDENTICAL | FLASH_PAGE_BLANK);
+#endif /* (SKIP_UNCHANGED_PAGES) */
+    }
 
-        case 1:
-            switch (cmd)
-            {
-                case CMD_SWITCH_APPLICATION:
-                    if (data == BOOTTYPE_APPLICATION)
-                    {
-                        cmd = CMD_BOOT_APPLICATION;
-                    }
+#if (SKIP_UNCHANGED_PAGES)
+    {
+        uint8_t old = read_flash_byte(addr + pos);
 
-                    ack = 0x00;
-                    break;
+        if (old != data)
+        {
+            page_cmp &= ~(FLASH_PAGE_IDENTICAL);
+        }
 
-                case CMD_ACCESS_MEMORY:
-                    if (data == MEMTYPE_CHIPINFO)
-                    {
-                        cmd = CMD_ACCESS_CHIPINFO;
-                    }
-                    else if (data == MEMTYPE_FLASH)
-                    {
-                        cmd = CMD_ACCESS_FLASH;
-                    }
-#if (EEPROM_SUPPORT)
-                    else if (data == MEMTYPE_EEPROM)
-                    {
-                        cmd = CMD_ACCESS_EEPROM;
-                    }
-#endif /* (EEPROM_SUPPORT) */
-                    else
-                    {
-                        ack = 0x00;
-                    }
-                    break;
+        if (old != 0xFF)
+        {
+            page_cmp &= ~(FLASH_PAGE_BLANK);
+        }
+    }
+#endif /* (SKIP_UNCHANGED_PAGES) */
 
-                default:
-                    ack = 0x00;
-                    break;
-            }
-            break;
+    if (pos & 0x01)
+    {
+        boot_page_fill(addr + pos, (data << 8) | fill_low);
+    }
+    else
+    {
+        fill_low = data;
+    }
+} /* fill_flash_byte */
+#endif /* (ZERO_COPY_FLASH) */
 
-        case 2:
-        case 3:
-            addr <<= 8;
-            addr |= data;
-            break;
 
-        default:
-            switch (cmd)
-            {
-#if (EEPROM_SUPPORT)
-#if (USE_CLOCKSTRETCH)
+/* *************************************************************************
+ * write_flash_page
+ * ************************************************************************* */
+static void write_flash_page(void)
+{
+    addr_t pagestart = addr;
+#if !(ZERO_COPY_FLASH)
+    pos_t size = SPM_PAGESIZE;
+    uint8_t *p = buf;
+#endif /* !(ZERO_COPY_FLASH) */
+
+    if (pagestart < BOOTLOADER_START)
+    {
+#if (STATUS_SUPPORT)
+        status_pages++;
+#endif /* (STATUS_SUPPORT) */
+
+#if (FAST_BOOT)
+        invalidate_app(pagestart);
+#endif /* (FAST_BOOT) */
+#if (JOURNAL_SUPPORT)
+        journal_invalidate(pagestart);
+#endif /* (JOURNAL_SUPPORT) */
+
+#if (ERASE_AHEAD)
+        uint8_t state = page_state;
+
+        page_state = 0;
+#if (SKIP_UNCHANGED_PAGES)
+        if (!(state & (PAGE_ERASE | PAGE_CHANGED)))
+        {
+#if (JOURNAL_SUPPORT)
+            journal_page(pagestart);
+#endif /* (JOURNAL_SUPPORT) */
+            addr += SPM_PAGESIZE;
+            return;
+        }
+#endif /* (SKIP_UNCHANGED_PAGES) */
+
+#if (BULK_ERASE_SUPPORT)
+        take_blank_page(pagestart);
+#endif /* (BULK_ERASE_SUPPORT) */
+
+        /* erase started during reception (if needed) */
+        if (state & PAGE_ERASE)
+        {
+            spm_busy_wait();
+        }
+#else
+#if (SKIP_UNCHANGED_PAGES)
+#if (ZERO_COPY_FLASH)
+        uint8_t state = page_cmp;
+#else
+        uint8_t state = compare_flash_page(pagestart, buf);
+#endif /* (ZERO_COPY_FLASH) */
+
+        /* page already holds the data, no SPM needed */
+        if (state & FLASH_PAGE_IDENTICAL)
+        {
+#if (JOURNAL_SUPPORT)
+            journal_page(pagestart);
+#endif /* (JOURNAL_SUPPORT) */
+            addr += SPM_PAGESIZE;
+            return;
+        }
+#endif /* (SKIP_UNCHANGED_PAGES) */
+
+#if (BULK_ERASE_SUPPORT)
+        /* erased by the bulk erase, only write needed */
+        if (!take_blank_page(pagestart))
+#endif /* (BULK_ERASE_SUPPORT) */
+#if (SKIP_UNCHANGED_PAGES)
+        /* page already erased, only write needed */
+        if (!(state & FLASH_PAGE_BLANK))
+#endif /* (SKIP_UNCHANGED_PAGES) */
+        {
+            boot_page_erase(pagestart);
+            spm_busy_wait();
+        }
+#endif /* (ERASE_AHEAD) */
+
+#if (ZERO_COPY_FLASH)
+        /* page buffer was filled while receiving, erase keeps it */
+        addr += SPM_PAGESIZE;
+#else
+        do {
+            uint16_t data = *p++;
+            data |= *p++ << 8;
+            boot_page_fill(addr, data);
+
+            addr += 2;
+            size -= 2;
+        } while (size);
+#endif /* (ZERO_COPY_FLASH) */
+
+        boot_page_write(pagestart);
+        spm_busy_wait();
+        boot_rww_enable();
+
+#if (JOURNAL_SUPPORT)
+        journal_page(pagestart);
+#endif /* (JOURNAL_SUPPORT) */
+    }
+#if (STATUS_SUPPORT)
+    else
+    {
+        status |= STATUS_ERR_ADDRESS;
+    }
+#endif /* (STATUS_SUPPORT) */
+} /* write_flash_page */
+
+
+#if (BULK_ERASE_SUPPORT)
+/* *************************************************************************
+ * erase_flash_range
+ * ************************************************************************* */
+static void erase_flash_range(void)
+{
+#if (FAST_BOOT)
+    invalidate_app(addr);
+#endif /* (FAST_BOOT) */
+
+    addr &= ~((addr_t)SPM_PAGESIZE -1);
+
+#if (JOURNAL_SUPPORT)
+    /* erased pages are no longer committed */
+    journal_truncate(addr);
+#endif /* (JOURNAL_SUPPORT) */
+
+    /* erase_pages == 0: wraps, ends at the bootloader section */
+    while (addr < BOOTLOADER_START)
+    {
+        uint16_t page = addr / SPM_PAGESIZE;
+        pos_t size = SPM_PAGESIZE;
+        addr_t pos = addr;
+
+        /* skip pages that are already blank */
+        do {
+            if (read_flash_byte(pos++) != 0xFF)
+            {
+                boot_page_erase(addr);
+                spm_busy_wait();
+                boot_rww_enable();
+                break;
+            }
+        } while (--size);
+
+        blank_map[page >> 3] |= (1 << (page & 0x07));
+        addr += SPM_PAGESIZE;
+
+        if (--erase_pages == 0)
+        {
+            break;
+        }
+    }
+
+    /* a following SLA+R, STO must not erase again */
+    cmd = CMD_WAIT;
+} /* erase_flash_range */
+#endif /* (BULK_ERASE_SUPPORT) */
+
+
+#if (FLASH_STREAM_SUPPORT)
+/* *************************************************************************
+ * stream_flash_poll
+ * ************************************************************************* */
+static void stream_flash_poll(void)
+{
+    if (boot_spm_busy())
+    {
+        return;
+    }
+
+    if (spm_state == SPM_ERASE)
+    {
+        addr_t pageaddr = spm_addr;
+        pos_t size = SPM_PAGESIZE;
+        uint8_t *p = spm_buf;
+
+        do {
+            uint16_t data = *p++;
+            data |= *p++ << 8;
+            boot_page_fill(pageaddr, data);
+
+            pageaddr += 2;
+            size -= 2;
+        } while (size);
+
+        boot_page_write(spm_addr);
+        spm_state = SPM_WRITE;
+    }
+    else if (spm_state == SPM_WRITE)
+    {
+        boot_rww_enable();
+        spm_state = SPM_IDLE;
+
+#if (JOURNAL_SUPPORT)
+        journal_page(spm_addr);
+#endif /* (JOURNAL_SUPPORT) */
+    }
+} /* stream_flash_poll */
+
+
+/* *************************************************************************
+ * stream_flash_wait
+ * ************************************************************************* */
+static void stream_flash_wait(void)
+{
+    while (spm_state != SPM_IDLE)
+    {
+#if (STATUS_SUPPORT)
+        TWI_busy_poll();
+#endif /* (STATUS_SUPPORT) */
+        stream_flash_poll();
+    }
+} /* stream_flash_wait */
+
+
+/* *************************************************************************
+ * stream_flash_byte
+ * ************************************************************************* */
+static void stream_flash_byte(pos_t pos, uint8_t data)
+{
+    rx_buf[pos] = data;
+
+    if (pos >= (SPM_PAGESIZE -1))
+    {
+        /* page complete, stretch clock until previous page is written */
+        stream_flash_wait();
+
+        if (addr < BOOTLOADER_START)
+        {
+#if (STATUS_SUPPORT)
+            status_pages++;
+#endif /* (STATUS_SUPPORT) */
+
+#if (FAST_BOOT)
+            invalidate_app(addr);
+#endif /* (FAST_BOOT) */
+#if (JOURNAL_SUPPORT)
+            journal_invalidate(addr);
+#endif /* (JOURNAL_SUPPORT) */
+
+#if (SKIP_UNCHANGED_PAGES)
+            uint8_t state = compare_flash_page(addr, rx_buf);
+
+            if (!(state & FLASH_PAGE_IDENTICAL))
+#endif /* (SKIP_UNCHANGED_PAGES) */
+            {
+                /* start erase, swap buffers and continue receiving */
+                spm_buf = rx_buf;
+                spm_addr = addr;
+                spm_state = SPM_ERASE;
+
+#if (BULK_ERASE_SUPPORT)
+                /* erased by the bulk erase, poll starts the write at once */
+                if (!take_blank_page(addr))
+#endif /* (BULK_ERASE_SUPPORT) */
+#if (SKIP_UNCHANGED_PAGES)
+                /* page already erased, poll starts the write at once */
+                if (!(state & FLASH_PAGE_BLANK))
+#endif /* (SKIP_UNCHANGED_PAGES) */
+                {
+                    boot_page_erase(addr);
+                }
+
+                rx_buf = (rx_buf == buf) ? stream_buf : buf;
+            }
+#if (SKIP_UNCHANGED_PAGES) && (JOURNAL_SUPPORT)
+            else
+            {
+                /* previous page is written, commit in order */
+                journal_page(addr);
+            }
+#endif /* (SKIP_UNCHANGED_PAGES) && (JOURNAL_SUPPORT) */
+
+            addr += SPM_PAGESIZE;
+        }
+#if (STATUS_SUPPORT)
+        else
+        {
+            status |= STATUS_ERR_ADDRESS;
+        }
+#endif /* (STATUS_SUPPORT) */
+
+        /* rewind byte counter, next byte is the first of the next page */
+        bcnt = DATA_START;
+    }
+} /* stream_flash_byte */
+#endif /* (FLASH_STREAM_SUPPORT) */
+
+
+#if (FLASH_LZ_SUPPORT)
+/* *************************************************************************
+ * lz_decode_byte
+ * ************************************************************************* */
+static uint8_t lz_decode_byte(uint8_t data)
+{
+    switch (lz_state)
+    {
+        case LZ_TOKEN:
+            if (data & 0x80)
+            {
+                lz_len = (data & 0x7F) +2;
+                lz_state = LZ_DISTANCE;
+            }
+            else
+            {
+                lz_len = data +1;
+                lz_state = LZ_LITERAL;
+            }
+            break;
+
+        case LZ_LITERAL:
+#if (ERASE_AHEAD)
+            erase_ahead(lz_pos, data);
+#endif /* (ERASE_AHEAD) */
+            buf[lz_pos++] = data;
+            if (--lz_len == 0)
+            {
+                lz_state = LZ_TOKEN;
+            }
+            break;
+
+        case LZ_DISTANCE:
+        {
+            uint8_t *src;
+
+            /* reference before page start */
+            if (data >= lz_pos)
+            {
+                return 0x00;
+            }
+
+            /* byte wise, source may overlap destination (runs) */
+            src = &buf[lz_pos - data -1];
+            do {
+#if (ERASE_AHEAD)
+                erase_ahead(lz_pos, *src);
+#endif /* (ERASE_AHEAD) */
+                buf[lz_pos++] = *src++;
+            } while (--lz_len && (lz_pos < SPM_PAGESIZE));
+
+            lz_state = LZ_TOKEN;
+            break;
+        }
+    }
+
+    /* no more data after the page is complete */
+    return (lz_pos < SPM_PAGESIZE);
+} /* lz_decode_byte */
+#endif /* (FLASH_LZ_SUPPORT) */
+
+
+#if (FLASH_DELTA_SUPPORT)
+/* *************************************************************************
+ * delta_decode_byte
+ * ************************************************************************* */
+static uint8_t delta_decode_byte(uint8_t data)
+{
+    switch (delta_state)
+    {
+        case DELTA_TOKEN:
+            if (data & 0x80)
+            {
+                delta_len = (data & 0x7F) +1;
+                delta_src = 0;
+                delta_state = DELTA_SOURCE + ADDR_BYTES -1;
+            }
+            else
+            {
+                delta_len = data +1;
+                delta_state = DELTA_LITERAL;
+            }
+            break;
+
+        case DELTA_LITERAL:
+            buf[delta_pos++] = data;
+            if (--delta_len == 0)
+            {
+                delta_state = DELTA_TOKEN;
+            }
+            break;
+
+        default:
+            /* source address, high byte first */
+            delta_src <<= 8;
+            delta_src |= data;
+
+            if (delta_state-- != DELTA_SOURCE)
+            {
+                break;
+            }
+
+            /* target page is not erased before the page write */
+            do {
+                buf[delta_pos++] = read_flash_byte(delta_src++);
+            } while (--delta_len && (delta_pos < SPM_PAGESIZE));
+
+            delta_state = DELTA_TOKEN;
+            break;
+    }
+
+    /* no more data after the page is complete */
+    return (delta_pos < SPM_PAGESIZE);
+} /* delta_decode_byte */
+#endif /* (FLASH_DELTA_SUPPORT) */
+
+
+#if (EEPROM_SUPPORT)
+/* *************************************************************************
+ * read_eeprom_byte
+ * ************************************************************************* */
+static uint8_t read_eeprom_byte(uint16_t address)
+{
+    EEARL = address;
+    EEARH = (address >> 8);
+    EECR |= (1<<EERE);
+
+    return EEDR;
+} /* read_eeprom_byte */
+
+
+#if (EEPROM_RESERVED)
+/* *************************************************************************
+ * eeprom_writable
+ * ************************************************************************* */
+static uint8_t eeprom_writable(addr_t address)
+{
+    if (address < EEPROM_SIZE)
+    {
+        return 1;
+    }
+
+#if (STATUS_SUPPORT)
+    status |= STATUS_ERR_ADDRESS;
+#endif /* (STATUS_SUPPORT) */
+    return 0;
+} /* eeprom_writable */
+#else
+#define eeprom_writable(address)    1
+#endif /* (EEPROM_RESERVED) */
+
+
+/* *************************************************************************
+ * start_eeprom_byte
+ * ************************************************************************* */
+static void start_eeprom_byte(uint16_t address, uint8_t val)
+{
+#if (EEPROM_SKIP_UNCHANGED)
+    /* also sets the address */
+    uint8_t old = read_eeprom_byte(address);
+
+    if (old == val)
+    {
+        return;
+    }
+
+#if defined (EEPM1)
+    /* only 1->0 bits: write only, 0xFF: erase only, else erase + write */
+    if ((old & val) == val)
+    {
+        EECR = (1<<EEPM1);
+    }
+    else if (val == 0xFF)
+    {
+        EECR = (1<<EEPM0);
+    }
+    else
+    {
+        EECR = 0x00;
+    }
+#endif /* defined (EEPM1) */
+#else
+    EEARL = address;
+    EEARH = (address >> 8);
+#endif /* (EEPROM_SKIP_UNCHANGED) */
+
+    EEDR = val;
+
+#if defined (EEWE)
+    EECR |= (1<<EEMWE);
+    EECR |= (1<<EEWE);
+#elif defined (EEPE)
+    EECR |= (1<<EEMPE);
+    EECR |= (1<<EEPE);
+#else
+#error "EEWE/EEPE not defined"
+#endif
+} /* start_eeprom_byte */
+
+
+/* *************************************************************************
+ * write_eeprom_byte
+ * ************************************************************************* */
+static void write_eeprom_byte(uint16_t address, uint8_t val)
+{
+    start_eeprom_byte(address, val);
+    ee_busy_wait();
+} /* write_eeprom_byte */
+
+
+#if (USE_CLOCKSTRETCH == 0)
+/* *************************************************************************
+ * write_eeprom_buffer
+ * ************************************************************************* */
+static void write_eeprom_buffer(pos_t size)
+{
+    uint8_t *p = buf;
+
+    while (size--)
+    {
+        if (eeprom_writable(addr))
+        {
+            write_eeprom_byte(addr, *p);
+        }
+        addr++;
+        p++;
+    }
+} /* write_eeprom_buffer */
+#endif /* (USE_CLOCKSTRETCH == 0) */
+
+
+#if (EEPROM_STREAM_SUPPORT)
+/* *************************************************************************
+ * stream_eeprom_poll
+ * ************************************************************************* */
+static void stream_eeprom_poll(void)
+{
+    if ((ee_tail != ee_head) && eeprom_is_ready())
+    {
+        uint8_t val = buf[ee_tail++ & (SPM_PAGESIZE -1)];
+
+        if (eeprom_writable(addr))
+        {
+            start_eeprom_byte(addr, val);
+        }
+        addr++;
+    }
+} /* stream_eeprom_poll */
+
+
+/* *************************************************************************
+ * stream_eeprom_wait
+ * ************************************************************************* */
+static void stream_eeprom_wait(void)
+{
+    while (ee_tail != ee_head)
+    {
+#if (STATUS_SUPPORT)
+        TWI_busy_poll();
+#endif /* (STATUS_SUPPORT) */
+        stream_eeprom_poll();
+    }
+
+    ee_busy_wait();
+} /* stream_eeprom_wait */
+
+
+/* *************************************************************************
+ * stream_eeprom_byte
+ * ************************************************************************* */
+static void stream_eeprom_byte(uint8_t data)
+{
+    /* ring buffer full, stretch clock until the oldest byte is started */
+    while ((pos_t)(ee_head - ee_tail) >= SPM_PAGESIZE)
+    {
+        stream_eeprom_poll();
+    }
+
+    buf[ee_head++ & (SPM_PAGESIZE -1)] = data;
+    stream_eeprom_poll();
+
+    /* rewind byte counter, the stream has no length limit */
+    bcnt = DATA_START;
+} /* stream_eeprom_byte */
+#endif /* (EEPROM_STREAM_SUPPORT) */
+#endif /* EEPROM_SUPPORT */
+
+
+#if (JOURNAL_SUPPORT)
+/* *************************************************************************
+ * journal_read_word
+ * ************************************************************************* */
+static uint16_t journal_read_word(uint16_t address)
+{
+    return (read_eeprom_byte(address) << 8) | read_eeprom_byte(address +1);
+} /* journal_read_word */
+
+
+/* *************************************************************************
+ * journal_write_byte
+ * ************************************************************************* */
+static void journal_write_byte(uint16_t address, uint8_t val)
+{
+    if (read_eeprom_byte(address) != val)
+    {
+        write_eeprom_byte(address, val);
+    }
+} /* journal_write_byte */
+
+
+/* *************************************************************************
+ * journal_store
+ * ************************************************************************* */
+static void journal_store(uint16_t pages)
+{
+    /* power loss between the bytes must not store more than committed:
+     * increase low byte first, decrease high byte first
+     */
+    if (pages > journal_read_word(JOURNAL_PAGES_ADDR))
+    {
+        journal_write_byte(JOURNAL_PAGES_ADDR +1, pages & 0xFF);
+        journal_write_byte(JOURNAL_PAGES_ADDR, pages >> 8);
+    }
+    else
+    {
+        journal_write_byte(JOURNAL_PAGES_ADDR, pages >> 8);
+        journal_write_byte(JOURNAL_PAGES_ADDR +1, pages & 0xFF);
+    }
+} /* journal_store */
+
+
+/* *************************************************************************
+ * journal_invalidate
+ * ************************************************************************* */
+static void journal_invalidate(addr_t address)
+{
+#if (STAGED_UPDATE_SUPPORT)
+    /* staged image: the journal of the application is kept */
+    if (address >= STAGE_START)
+    {
+        return;
+    }
+#endif /* (STAGED_UPDATE_SUPPORT) */
+
+    /* flash written without a started journal */
+    if (journal_state == JOURNAL_UNKNOWN)
+    {
+        journal_state = JOURNAL_IDLE;
+        journal_store(0);
+    }
+} /* journal_invalidate */
+
+
+#if (BULK_ERASE_SUPPORT)
+/* *************************************************************************
+ * journal_truncate
+ * ************************************************************************* */
+static void journal_truncate(addr_t pagestart)
+{
+    uint16_t page = pagestart / SPM_PAGESIZE;
+
+    journal_invalidate(pagestart);
+
+    if ((journal_state == JOURNAL_ACTIVE) && (journal_pages > page))
+    {
+        journal_pages = page;
+        journal_store(page);
+    }
+} /* journal_truncate */
+#endif /* (BULK_ERASE_SUPPORT) */
+
+
+/* *************************************************************************
+ * journal_page
+ * ************************************************************************* */
+static void journal_page(addr_t pagestart)
+{
+    /* only consecutive pages from address 0 are committed */
+    if ((journal_state == JOURNAL_ACTIVE) &&
+        ((pagestart / SPM_PAGESIZE) == journal_pages))
+    {
+        journal_pages++;
+        if ((journal_pages % JOURNAL_INTERVAL) == 0)
+        {
+            journal_store(journal_pages);
+        }
+    }
+} /* journal_page */
+
+
+/* *************************************************************************
+ * start_journal
+ * ************************************************************************* */
+static void start_journal(void)
+{
+    uint16_t pages = journal_read_word(JOURNAL_PAGES_ADDR);
+
+    /* other image (or erased eeprom): no pages committed */
+    if ((journal_read_word(JOURNAL_ADDR) != journal_id) ||
+        (pages > JOURNAL_MAX_PAGES))
+    {
+        pages = 0;
+
+        /* clear the pages before the id is changed */
+        journal_store(pages);
+        journal_write_byte(JOURNAL_ADDR, journal_id >> 8);
+        journal_write_byte(JOURNAL_ADDR +1, journal_id & 0xFF);
+    }
+
+    journal_pages = pages;
+    journal_state = JOURNAL_ACTIVE;
+
+    /* a following SLA+R reads the journal */
+    cmd = CMD_ACCESS_JOURNAL;
+} /* start_journal */
+#endif /* (JOURNAL_SUPPORT) */
+
+
+#if (SERVICE_TABLE_SUPPORT)
+/*
+ * Entry points of the service table, called by the application with its
+ * own stack and RAM: no bootloader variables, no status polling.
+ * Interrupts are disabled while the RWW section is not readable.
+ */
+
+/* *************************************************************************
+ * service_page_erase
+ * ************************************************************************* */
+uint8_t service_page_erase(addr_t address)
+{
+    uint8_t sreg;
+
+    if (address >= BOOTLOADER_START)
+    {
+        return 0x01;
+    }
+
+    /* SPM is not allowed while the eeprom is written */
+    eeprom_busy_wait();
+
+    sreg = SREG;
+    cli();
+    boot_page_erase(address);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+    SREG = sreg;
+
+    return 0x00;
+} /* service_page_erase */
+
+
+/* *************************************************************************
+ * service_page_fill
+ * ************************************************************************* */
+void service_page_fill(addr_t address, uint16_t data)
+{
+    uint8_t sreg = SREG;
+
+    cli();
+    boot_page_fill(address, data);
+    SREG = sreg;
+} /* service_page_fill */
+
+
+/* *************************************************************************
+ * service_page_write
+ * ************************************************************************* */
+uint8_t service_page_write(addr_t address)
+{
+    uint8_t sreg;
+
+    if (address >= BOOTLOADER_START)
+    {
+        return 0x01;
+    }
+
+    eeprom_busy_wait();
+
+    sreg = SREG;
+    cli();
+    boot_page_write(address);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+    SREG = sreg;
+
+    return 0x00;
+} /* service_page_write */
+
+
+#if (EEPROM_SUPPORT)
+/* *************************************************************************
+ * service_eeprom_write
+ * ************************************************************************* */
+void service_eeprom_write(uint16_t address, uint8_t val)
+{
+    uint8_t sreg;
+
+    /* returns while the byte is written, the next call waits */
+    eeprom_busy_wait();
+
+    sreg = SREG;
+    cli();
+    start_eeprom_byte(address, val);
+    SREG = sreg;
+} /* service_eeprom_write */
+#endif /* (EEPROM_SUPPORT) */
+#endif /* (SERVICE_TABLE_SUPPORT) */
+
+
+#if (ADDRESS_ASSIGN_SUPPORT) || (ADDRESS_STRAP_PINS)
+/* *************************************************************************
+ * twi_address
+ * ************************************************************************* */
+static uint8_t twi_address(void)
+{
+#if (ADDRESS_ASSIGN_SUPPORT)
+    uint8_t address = read_eeprom_byte(ADDRESS_EEPROM_ADDR);
+
+    if ((address >= ADDRESS_MIN) && (address <= ADDRESS_MAX))
+    {
+        return address;
+    }
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+#if (ADDRESS_STRAP_PINS)
+    return TWI_ADDRESS + STRAP_READ();
+#else
+    return TWI_ADDRESS;
+#endif /* (ADDRESS_STRAP_PINS) */
+} /* twi_address */
+
+#define SLAVE_ADDRESS       twi_address()
+#else
+#define SLAVE_ADDRESS       TWI_ADDRESS
+#endif /* (ADDRESS_ASSIGN_SUPPORT) || (ADDRESS_STRAP_PINS) */
+
+
+#if (GROUP_ADDRESS_SUPPORT)
+/* *************************************************************************
+ * group_mask
+ * ************************************************************************* */
+static uint8_t group_mask(uint8_t address)
+{
+    uint8_t group = TWI_GROUP_ADDRESS;
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+    uint8_t stored = read_eeprom_byte(GROUP_EEPROM_ADDR);
+
+    if (stored != 0xFF)
+    {
+        group = stored;
+    }
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+    if ((group < ADDRESS_MIN) || (group > ADDRESS_MAX))
+    {
+        return 0x00;
+    }
+
+    /* TWAMR: bits 7..1 */
+    return (address ^ group) << 1;
+} /* group_mask */
+#endif /* (GROUP_ADDRESS_SUPPORT) */
+
+
+/* *************************************************************************
+ * set_slave_address
+ * ************************************************************************* */
+static void set_slave_address(void)
+{
+    uint8_t address = SLAVE_ADDRESS;
+
+#if (GENERAL_CALL_SUPPORT)
+    TWAR = (address<<1) | (1<<TWGCE);
+#else
+    TWAR = (address<<1);
+#endif /* (GENERAL_CALL_SUPPORT) */
+
+#if (GROUP_ADDRESS_SUPPORT)
+    TWAMR = group_mask(address);
+#endif /* (GROUP_ADDRESS_SUPPORT) */
+} /* set_slave_address */
+
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+/* *************************************************************************
+ * assign_address
+ * ************************************************************************* */
+static void assign_address(void)
+{
+    uint8_t address = new_address >> 8;
+    uint16_t cell = ADDRESS_EEPROM_ADDR;
+
+    /* 0xFF clears the assignment */
+    uint8_t valid = ((address >= ADDRESS_MIN) && (address <= ADDRESS_MAX)) ||
+                    (address == 0xFF);
+
+#if (GROUP_ADDRESS_SUPPORT)
+    /* address 0x0001: group address, 0x00 disables the group */
+    if (addr == 1)
+    {
+        cell = GROUP_EEPROM_ADDR;
+        valid |= (address == 0x00);
+    }
+    else
+#endif /* (GROUP_ADDRESS_SUPPORT) */
+    if (addr != 0)
+    {
+        valid = 0;
+    }
+
+    /* complement protects against stray writes */
+    if (!valid || ((uint8_t)~address != (new_address & 0xFF)))
+    {
+#if (STATUS_SUPPORT)
+        status |= STATUS_ERR_ADDRESS;
+#endif /* (STATUS_SUPPORT) */
+        return;
+    }
+
+    write_eeprom_byte(cell, address);
+
+    /* applies to the next transaction */
+    set_slave_address();
+} /* assign_address */
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+
+#if (CRC_SUPPORT)
+/* *************************************************************************
+ * calc_crc
+ * ************************************************************************* */
+static void calc_crc(void)
+{
+    uint16_t len = crc;
+
+    crc = 0xFFFF;
+    while (len--)
+    {
+        uint8_t data;
+
+#if (EEPROM_SUPPORT)
+        if (cmd == CMD_ACCESS_EEPROM_CRC)
+        {
+            data = read_eeprom_byte(addr);
+        }
+        else
+#endif /* (EEPROM_SUPPORT) */
+        {
+            data = read_flash_byte(addr);
+        }
+
+        crc = _crc_xmodem_update(crc, data);
+        addr++;
+    }
+
+    cmd = CMD_ACCESS_CRC;
+} /* calc_crc */
+#endif /* (CRC_SUPPORT) */
+
+
+/* *************************************************************************
+ * TWI_data_write
+ * ************************************************************************* */
+static uint8_t TWI_data_write(pos_t count, uint8_t data)
+{
+    uint8_t ack = 0x01;
+
+    switch (count)
+    {
+        case 0:
+            switch (data)
+            {
+                case CMD_SWITCH_APPLICATION:
+                case CMD_ACCESS_MEMORY:
+                    /* no break */
+
+                case CMD_WAIT:
+                    /* abort countdown */
+                    boot_timeout = 0;
+                    cmd = data;
+                    break;
+
+                default:
+#if (GENERAL_CALL_SUPPORT)
+                    /* general call commands of other devices (0x04, 0x06, ...): ignore */
+                    if (general_call)
+                    {
+                        cmd = CMD_WAIT;
+                        ack = 0x00;
+                        break;
+                    }
+#endif /* (GENERAL_CALL_SUPPORT) */
+
+                    /* boot app now */
+                    cmd = CMD_BOOT_APPLICATION;
+                    ack = 0x00;
+                    break;
+            }
+            break;
+
+        case 1:
+            switch (cmd)
+            {
+                case CMD_SWITCH_APPLICATION:
+                    if (data == BOOTTYPE_APPLICATION)
+                    {
+                        cmd = CMD_BOOT_APPLICATION;
+                    }
+
+                    ack = 0x00;
+                    break;
+
+                case CMD_ACCESS_MEMORY:
+#if (STATUS_SUPPORT)
+                    /* errors of the previous access */
+                    status = 0x00;
+#endif /* (STATUS_SUPPORT) */
+
+                    if (data == MEMTYPE_CHIPINFO)
+                    {
+                        cmd = CMD_ACCESS_CHIPINFO;
+                    }
+                    else if (data == MEMTYPE_FLASH)
+                    {
+                        cmd = CMD_ACCESS_FLASH;
+                    }
+#if (EEPROM_SUPPORT)
+                    else if (data == MEMTYPE_EEPROM)
+                    {
+                        cmd = CMD_ACCESS_EEPROM;
+                    }
+#endif /* (EEPROM_SUPPORT) */
+#if (FLASH_STREAM_SUPPORT)
+                    else if (data == MEMTYPE_FLASH_STREAM)
+                    {
+                        cmd = CMD_ACCESS_STREAM;
+                    }
+#endif /* (FLASH_STREAM_SUPPORT) */
+#if (FLASH_LZ_SUPPORT)
+                    else if (data == MEMTYPE_FLASH_LZ)
+                    {
+                        cmd = CMD_ACCESS_FLASH_LZ;
+                        lz_pos = 0;
+                        lz_state = LZ_TOKEN;
+                    }
+#endif /* (FLASH_LZ_SUPPORT) */
+#if (FLASH_DELTA_SUPPORT)
+                    else if (data == MEMTYPE_FLASH_DELTA)
+                    {
+                        cmd = CMD_ACCESS_FLASH_DELTA;
+                        delta_pos = 0;
+                        delta_state = DELTA_TOKEN;
+                    }
+#endif /* (FLASH_DELTA_SUPPORT) */
+#if (EEPROM_STREAM_SUPPORT)
+                    else if (data == MEMTYPE_EEPROM_STREAM)
+                    {
+                        cmd = CMD_ACCESS_EEPROM_STREAM;
+                        ee_head = 0;
+                        ee_tail = 0;
+                    }
+#endif /* (EEPROM_STREAM_SUPPORT) */
+#if (BULK_ERASE_SUPPORT)
+                    else if (data == MEMTYPE_FLASH_ERASE)
+                    {
+                        cmd = CMD_ACCESS_ERASE;
+                    }
+#endif /* (BULK_ERASE_SUPPORT) */
+#if (CRC_SUPPORT)
+                    else if (data == MEMTYPE_FLASH_CRC)
+                    {
+                        cmd = CMD_ACCESS_FLASH_CRC;
+                    }
+#if (EEPROM_SUPPORT)
+                    else if (data == MEMTYPE_EEPROM_CRC)
+                    {
+                        cmd = CMD_ACCESS_EEPROM_CRC;
+                    }
+#endif /* (EEPROM_SUPPORT) */
+#endif /* (CRC_SUPPORT) */
+#if (PAGE_CRC_SUPPORT)
+                    else if (data == MEMTYPE_PAGE_CRC)
+                    {
+                        cmd = CMD_ACCESS_PAGE_CRC;
+                    }
+#endif /* (PAGE_CRC_SUPPORT) */
+#if (DESCRIPTOR_SUPPORT)
+                    else if (data == MEMTYPE_DESCRIPTOR)
+                    {
+                        cmd = CMD_ACCESS_DESCRIPTOR;
+                    }
+#endif /* (DESCRIPTOR_SUPPORT) */
+#if (JOURNAL_SUPPORT)
+                    else if (data == MEMTYPE_JOURNAL)
+                    {
+                        cmd = CMD_ACCESS_JOURNAL;
+                    }
+#endif /* (JOURNAL_SUPPORT) */
+#if (ADDRESS_ASSIGN_SUPPORT)
+                    else if (data == MEMTYPE_ADDRESS)
+                    {
+                        cmd = CMD_ACCESS_ADDRESS;
+                    }
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+                    else
+                    {
+                        ack = 0x00;
+                    }
+                    break;
+
+                default:
+                    ack = 0x00;
+                    break;
+            }
+            break;
+
+        case 2:
+        case 3:
+#if (ADDR_BYTES > 2)
+        case 4:
+            /* drop the upper byte of the previous address */
+            addr = (addr << 8) & 0xFFFF00;
+#else
+            addr <<= 8;
+#endif
+            addr |= data;
+#if (ERASE_AHEAD)
+            page_state = 0;
+#endif /* (ERASE_AHEAD) */
+            break;
+
+        default:
+            switch (cmd)
+            {
+#if (EEPROM_SUPPORT)
+#if (USE_CLOCKSTRETCH)
                 case CMD_ACCESS_EEPROM:
-                    write_eeprom_byte(data);
+                    if (eeprom_writable(addr))
+                    {
+                        write_eeprom_byte(addr, data);
+                    }
+                    addr++;
                     break;
 #else
                 case CMD_ACCESS_EEPROM:
@@ -313,26 +2043,182 @@ static uint8_t TWI_data_write(uint8_t bcnt, uint8_t data)
 #endif /* (EEPROM_SUPPORT) */
                 case CMD_ACCESS_FLASH:
                 {
-                    uint8_t pos = bcnt -4;
+                    pos_t pos = count - DATA_START;
 
+#if (ERASE_AHEAD)
+                    if (cmd == CMD_ACCESS_FLASH)
+                    {
+                        erase_ahead(pos, data);
+                    }
+#endif /* (ERASE_AHEAD) */
+#if (ZERO_COPY_FLASH)
+                    if (cmd == CMD_ACCESS_FLASH)
+                    {
+                        fill_flash_byte(pos, data);
+                    }
+#if (EEPROM_SUPPORT) && (USE_CLOCKSTRETCH == 0)
+                    else
+                    {
+                        buf[pos] = data;
+                    }
+#endif
+#else
                     buf[pos] = data;
-                    if (pos >= (sizeof(buf) -2))
+#endif /* (ZERO_COPY_FLASH) */
+                    if (pos >= (SPM_PAGESIZE -2))
                     {
                         ack = 0x00;
                     }
 
                     if ((cmd == CMD_ACCESS_FLASH) &&
-                        (pos >= (sizeof(buf) -1))
+                        (pos >= (SPM_PAGESIZE -1))
                        )
                     {
-#if (USE_CLOCKSTRETCH)
-                        write_flash_page();
-#else
-                        cmd = CMD_WRITE_FLASH_PAGE;
-#endif
+#if (USE_CLOCKSTRETCH)
+                        write_flash_page();
+#else
+                        cmd = CMD_WRITE_FLASH_PAGE;
+#endif
+                    }
+                    break;
+                }
+
+#if (FLASH_STREAM_SUPPORT)
+                case CMD_ACCESS_STREAM:
+                    stream_flash_byte(count - DATA_START, data);
+                    break;
+#endif /* (FLASH_STREAM_SUPPORT) */
+
+#if (EEPROM_STREAM_SUPPORT)
+                case CMD_ACCESS_EEPROM_STREAM:
+                    stream_eeprom_byte(data);
+                    break;
+#endif /* (EEPROM_STREAM_SUPPORT) */
+
+#if (BULK_ERASE_SUPPORT)
+                case CMD_ACCESS_ERASE:
+                    erase_pages <<= 8;
+                    erase_pages |= data;
+
+                    if (count == DATA_START)
+                    {
+                        ack = 0x00;
+                    }
+                    else
+                    {
+                        /* only a complete command erases */
+#if (USE_CLOCKSTRETCH)
+                        erase_flash_range();
+#else
+                        cmd = CMD_ERASE_FLASH;
+#endif /* (USE_CLOCKSTRETCH) */
+                    }
+                    break;
+#endif /* (BULK_ERASE_SUPPORT) */
+
+#if (JOURNAL_SUPPORT)
+                case CMD_ACCESS_JOURNAL:
+                    journal_id <<= 8;
+                    journal_id |= data;
+
+                    if (count == DATA_START)
+                    {
+                        ack = 0x00;
+                    }
+                    else
+                    {
+                        /* only a complete image id starts the journal */
+#if (USE_CLOCKSTRETCH)
+                        start_journal();
+#else
+                        cmd = CMD_START_JOURNAL;
+#endif /* (USE_CLOCKSTRETCH) */
+                    }
+                    break;
+#endif /* (JOURNAL_SUPPORT) */
+
+#if (ADDRESS_ASSIGN_SUPPORT)
+                case CMD_ACCESS_ADDRESS:
+                    new_address <<= 8;
+                    new_address |= data;
+
+                    if (count == DATA_START)
+                    {
+                        ack = 0x00;
+                    }
+                    else
+                    {
+#if (USE_CLOCKSTRETCH)
+                        assign_address();
+#else
+                        cmd = CMD_ASSIGN_ADDRESS;
+#endif /* (USE_CLOCKSTRETCH) */
+                    }
+                    break;
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+
+#if (FLASH_LZ_SUPPORT)
+                case CMD_ACCESS_FLASH_LZ:
+                    /* NACKed byte after the complete page is ignored */
+                    if (lz_pos >= SPM_PAGESIZE)
+                    {
+                        ack = 0x00;
+                        break;
+                    }
+
+                    ack = lz_decode_byte(data);
+                    if (lz_pos >= SPM_PAGESIZE)
+                    {
+#if (USE_CLOCKSTRETCH)
+                        write_flash_page();
+#else
+                        cmd = CMD_WRITE_FLASH_PAGE;
+#endif
+                    }
+                    break;
+#endif /* (FLASH_LZ_SUPPORT) */
+
+#if (FLASH_DELTA_SUPPORT)
+                case CMD_ACCESS_FLASH_DELTA:
+                    /* NACKed byte after the complete page is ignored */
+                    if (delta_pos >= SPM_PAGESIZE)
+                    {
+                        ack = 0x00;
+                        break;
+                    }
+
+                    ack = delta_decode_byte(data);
+                    if (delta_pos >= SPM_PAGESIZE)
+                    {
+#if (USE_CLOCKSTRETCH)
+                        write_flash_page();
+#else
+                        cmd = CMD_WRITE_FLASH_PAGE;
+#endif
+                    }
+                    break;
+#endif /* (FLASH_DELTA_SUPPORT) */
+
+#if (CRC_SUPPORT)
+                case CMD_ACCESS_FLASH_CRC:
+#if (EEPROM_SUPPORT)
+                case CMD_ACCESS_EEPROM_CRC:
+#endif /* (EEPROM_SUPPORT) */
+                    crc <<= 8;
+                    crc |= data;
+
+                    if (count == DATA_START)
+                    {
+                        ack = 0x00;
+                    }
+#if (USE_CLOCKSTRETCH)
+                    else
+                    {
+                        calc_crc();
                     }
+#endif /* (USE_CLOCKSTRETCH) */
                     break;
-                }
+#endif /* (CRC_SUPPORT) */
 
                 default:
                     ack = 0x00;
@@ -345,27 +2231,74 @@ static uint8_t TWI_data_write(uint8_t bcnt, uint8_t data)
 } /* TWI_data_write */
 
 
+#if (STATUS_SUPPORT)
+/* *************************************************************************
+ * TWI_status_read
+ * ************************************************************************* */
+static uint8_t TWI_status_read(pos_t count)
+{
+    uint8_t data;
+
+    switch (count % 3)
+    {
+        case 0:
+            data = status & ~(STATUS_XFER);
+            break;
+
+        case 1:
+            data = status_pages >> 8;
+            break;
+
+        default:
+            data = status_pages & 0xFF;
+            break;
+    }
+
+    return data;
+} /* TWI_status_read */
+#endif /* (STATUS_SUPPORT) */
+
+
 /* *************************************************************************
  * TWI_data_read
  * ************************************************************************* */
-static uint8_t TWI_data_read(uint8_t bcnt)
+static uint8_t TWI_data_read(pos_t count)
 {
     uint8_t data;
 
     switch (cmd)
     {
         case CMD_READ_VERSION:
-            bcnt %= sizeof(info);
-            data = info[bcnt];
+            count %= sizeof(info);
+            data = info[count];
             break;
 
         case CMD_ACCESS_CHIPINFO:
-            bcnt %= sizeof(chipinfo);
-            data = chipinfo[bcnt];
+            count %= sizeof(chipinfo);
+            data = chipinfo[count];
+            break;
+
+#if (DESCRIPTOR_SUPPORT)
+        case CMD_ACCESS_DESCRIPTOR:
+            count %= sizeof(descriptor);
+            data = descriptor[count];
+            break;
+#endif /* (DESCRIPTOR_SUPPORT) */
+
+#if (JOURNAL_SUPPORT)
+        case CMD_ACCESS_JOURNAL:
+            data = read_eeprom_byte(JOURNAL_ADDR + (count % JOURNAL_SIZE));
+            break;
+#endif /* (JOURNAL_SUPPORT) */
+
+#if (STATUS_SUPPORT)
+        case CMD_READ_STATUS:
+            data = TWI_status_read(count);
             break;
+#endif /* (STATUS_SUPPORT) */
 
         case CMD_ACCESS_FLASH:
-            data = pgm_read_byte_near(addr++);
+            data = read_flash_byte(addr++);
             break;
 
 #if (EEPROM_SUPPORT)
@@ -374,6 +2307,30 @@ static uint8_t TWI_data_read(uint8_t bcnt)
             break;
 #endif /* (EEPROM_SUPPORT) */
 
+#if (CRC_SUPPORT)
+        case CMD_ACCESS_CRC:
+            data = (count & 0x01) ? (crc & 0xFF) : (crc >> 8);
+            break;
+#endif /* (CRC_SUPPORT) */
+
+#if (PAGE_CRC_SUPPORT)
+        case CMD_ACCESS_PAGE_CRC:
+            if ((count & 0x01) == 0)
+            {
+                pos_t i;
+
+                /* next page, calculated while the clock is stretched */
+                crc = 0xFFFF;
+                for (i = 0; i < SPM_PAGESIZE; i++)
+                {
+                    crc = _crc_xmodem_update(crc, read_flash_byte(addr++));
+                }
+            }
+
+            data = (count & 0x01) ? (crc & 0xFF) : (crc >> 8);
+            break;
+#endif /* (PAGE_CRC_SUPPORT) */
+
         default:
             data = 0xFF;
             break;
@@ -383,24 +2340,140 @@ static uint8_t TWI_data_read(uint8_t bcnt)
 } /* TWI_data_read */
 
 
+#if (STATUS_SUPPORT) || (USE_CLOCKSTRETCH == 0) || \
+    (FLASH_STREAM_SUPPORT) || (EEPROM_STREAM_SUPPORT) || (ERASE_AHEAD)
+/* *************************************************************************
+ * TWI_busy_begin
+ * ************************************************************************* */
+static void TWI_busy_begin(uint8_t control)
+{
+#if (STATUS_SUPPORT)
+    /* bus already released by a previous step */
+    if (status & STATUS_BUSY)
+    {
+        return;
+    }
+
+    /* keep ACK (also after a NACKed last byte), TWI_busy_poll() answers until done */
+    control |= (1<<TWEA);
+    status |= STATUS_BUSY;
+#else
+    /* disable ACK for now, re-enable when done */
+    control &= ~(1<<TWEA);
+#endif /* (STATUS_SUPPORT) */
+
+    TWCR = (1<<TWINT) | control;
+} /* TWI_busy_begin */
+#endif /* (STATUS_SUPPORT) || (USE_CLOCKSTRETCH == 0) || ... */
+
+
+#if (STATUS_SUPPORT)
+/* *************************************************************************
+ * TWI_busy_poll
+ * ************************************************************************* */
+static void TWI_busy_poll(void)
+{
+    uint8_t control;
+
+    /* not after STOP (e.g. clock stretched page write) */
+    if (!(status & STATUS_BUSY))
+    {
+        return;
+    }
+
+    control = TWCR;
+    if (!(control & (1<<TWINT)))
+    {
+        return;
+    }
+
+    control |= (1<<TWEA);
+
+    switch (TWSR & 0xF8)
+    {
+        /* SLA+R received, ACK returned -> send status */
+        case 0xA8:
+            status_pos = 0;
+#if (GROUP_ADDRESS_SUPPORT)
+            /* masked address: all members answer, send 0xFF (SDA released) as last byte */
+            if ((TWDR ^ TWAR) & 0xFE)
+            {
+                TWDR = 0xFF;
+                control &= ~(1<<TWEA);
+                status |= STATUS_XFER;
+                break;
+            }
+#endif /* (GROUP_ADDRESS_SUPPORT) */
+            /* fall through */
+
+        /* prev. SLA+R, data sent, ACK returned -> send status */
+        case 0xB8:
+            TWDR = TWI_status_read(status_pos++);
+            status |= STATUS_XFER;
+            break;
+
+        /* SLA+W received, ACK returned -> busy, NACK data */
+        case 0x60:
+#if (GENERAL_CALL_SUPPORT)
+        case 0x70:
+#endif /* (GENERAL_CALL_SUPPORT) */
+            control &= ~(1<<TWEA);
+            status |= STATUS_XFER;
+            break;
+
+        /* data NACKed, STOP, repeated START or status read done -> IDLE */
+        case 0x88:
+#if (GENERAL_CALL_SUPPORT)
+        case 0x98:
+#endif /* (GENERAL_CALL_SUPPORT) */
+        case 0xA0:
+        case 0xC0:
+        case 0xC8:
+            status &= ~(STATUS_XFER);
+            break;
+
+        /* illegal state(s) -> reset hardware */
+        default:
+            control |= (1<<TWSTO);
+            status &= ~(STATUS_XFER);
+            break;
+    }
+
+    TWCR = (1<<TWINT) | control;
+} /* TWI_busy_poll */
+#endif /* (STATUS_SUPPORT) */
+
+
 /* *************************************************************************
  * TWI_vect
  * ************************************************************************* */
+#if (USE_INTERRUPTS)
+ISR(TWI_vect)
+#else
 static void TWI_vect(void)
+#endif
 {
-    static uint8_t bcnt;
     uint8_t control = TWCR;
 
     switch (TWSR & 0xF8)
     {
         /* SLA+W received, ACK returned -> receive data and ACK */
         case 0x60:
+#if (GENERAL_CALL_SUPPORT)
+        /* general call received, ACK returned -> receive data and ACK */
+        case 0x70:
+            general_call = ((TWSR & 0xF8) == 0x70);
+#endif /* (GENERAL_CALL_SUPPORT) */
             bcnt = 0;
             LED_RT_ON();
             break;
 
         /* prev. SLA+W, data received, ACK returned -> receive data and ACK */
         case 0x80:
+#if (GENERAL_CALL_SUPPORT)
+        /* prev. general call, data received, ACK returned -> receive data and ACK */
+        case 0x90:
+#endif /* (GENERAL_CALL_SUPPORT) */
             if (TWI_data_write(bcnt++, TWDR) == 0x00)
             {
                 control &= ~(1<<TWEA);
@@ -411,6 +2484,15 @@ static void TWI_vect(void)
         case 0xA8:
             bcnt = 0;
             LED_RT_ON();
+#if (GROUP_ADDRESS_SUPPORT)
+            /* masked address: all members answer, send 0xFF (SDA released) as last byte */
+            if ((TWDR ^ TWAR) & 0xFE)
+            {
+                TWDR = 0xFF;
+                control &= ~(1<<TWEA);
+                break;
+            }
+#endif /* (GROUP_ADDRESS_SUPPORT) */
 
         /* prev. SLA+R, data sent, ACK returned -> send data */
         case 0xB8:
@@ -419,40 +2501,183 @@ static void TWI_vect(void)
 
         /* prev. SLA+W, data received, NACK returned -> IDLE */
         case 0x88:
+#if (GENERAL_CALL_SUPPORT)
+        /* prev. general call, data received, NACK returned -> IDLE */
+        case 0x98:
+#endif /* (GENERAL_CALL_SUPPORT) */
+#if (STATUS_SUPPORT)
+        {
+            uint8_t data = TWDR;
+
+            /* a clock stretched page write of the last byte is busy as well */
+            TWI_busy_begin(control);
+            TWI_data_write(bcnt++, data);
+        }
+#else
             TWI_data_write(bcnt++, TWDR);
+#endif /* (STATUS_SUPPORT) */
             /* fall through */
 
         /* STOP or repeated START -> IDLE */
         case 0xA0:
+#if (STATUS_SUPPORT)
+            /* flash data received, but no complete page to write */
+            if ((bcnt > DATA_START) &&
+                (((cmd == CMD_ACCESS_FLASH) && (bcnt < (DATA_START + SPM_PAGESIZE)))
+#if (FLASH_STREAM_SUPPORT)
+                 || (cmd == CMD_ACCESS_STREAM)
+#endif
+#if (FLASH_LZ_SUPPORT)
+                 || ((cmd == CMD_ACCESS_FLASH_LZ) && (lz_pos < SPM_PAGESIZE))
+#endif
+#if (FLASH_DELTA_SUPPORT)
+                 || ((cmd == CMD_ACCESS_FLASH_DELTA) && (delta_pos < SPM_PAGESIZE))
+#endif
+#if (CRC_SUPPORT)
+                 || ((cmd == CMD_ACCESS_FLASH_CRC) && (bcnt < (DATA_START + 2)))
+#if (EEPROM_SUPPORT)
+                 || ((cmd == CMD_ACCESS_EEPROM_CRC) && (bcnt < (DATA_START + 2)))
+#endif
+#endif
+                ))
+            {
+                status |= STATUS_ERR_LENGTH;
+            }
+#endif /* (STATUS_SUPPORT) */
+
+#if (FLASH_STREAM_SUPPORT)
+            if (cmd == CMD_ACCESS_STREAM)
+            {
+                /* busy until the last page is written */
+                TWI_busy_begin(control);
+                stream_flash_wait();
+            }
+#endif /* (FLASH_STREAM_SUPPORT) */
+
+#if (EEPROM_STREAM_SUPPORT)
+            if (cmd == CMD_ACCESS_EEPROM_STREAM)
+            {
+                /* busy until the last eeprom byte is written */
+                TWI_busy_begin(control);
+                stream_eeprom_wait();
+            }
+#endif /* (EEPROM_STREAM_SUPPORT) */
+
 #if (USE_CLOCKSTRETCH == 0)
             if ((cmd == CMD_WRITE_FLASH_PAGE)
 #if (EEPROM_SUPPORT)
                 || (cmd == CMD_WRITE_EEPROM_PAGE)
+#endif
+#if (BULK_ERASE_SUPPORT)
+                || (cmd == CMD_ERASE_FLASH)
+#endif
+#if (JOURNAL_SUPPORT)
+                || (cmd == CMD_START_JOURNAL)
+#endif
+#if (ADDRESS_ASSIGN_SUPPORT)
+                || (cmd == CMD_ASSIGN_ADDRESS)
+#endif
+#if (CRC_SUPPORT)
+                || (((cmd == CMD_ACCESS_FLASH_CRC)
+#if (EEPROM_SUPPORT)
+                     || (cmd == CMD_ACCESS_EEPROM_CRC)
+#endif
+                    ) && (bcnt == DATA_START + 2))
 #endif
                )
             {
-                /* disable ACK for now, re-enable after page write */
-                control &= ~(1<<TWEA);
-                TWCR = (1<<TWINT) | control;
+                /* busy until the page is written */
+                TWI_busy_begin(control);
 
 #if (EEPROM_SUPPORT)
                 if (cmd == CMD_WRITE_EEPROM_PAGE)
                 {
-                    write_eeprom_buffer(bcnt -4);
+                    write_eeprom_buffer(bcnt - DATA_START);
                 }
                 else
 #endif /* (EEPROM_SUPPORT) */
+#if (BULK_ERASE_SUPPORT)
+                if (cmd == CMD_ERASE_FLASH)
+                {
+                    erase_flash_range();
+                }
+                else
+#endif /* (BULK_ERASE_SUPPORT) */
+#if (JOURNAL_SUPPORT)
+                if (cmd == CMD_START_JOURNAL)
+                {
+                    start_journal();
+                }
+                else
+#endif /* (JOURNAL_SUPPORT) */
+#if (ADDRESS_ASSIGN_SUPPORT)
+                if (cmd == CMD_ASSIGN_ADDRESS)
+                {
+                    assign_address();
+                }
+                else
+#endif /* (ADDRESS_ASSIGN_SUPPORT) */
+#if (CRC_SUPPORT)
+                if (cmd != CMD_WRITE_FLASH_PAGE)
+                {
+                    calc_crc();
+                }
+                else
+#endif /* (CRC_SUPPORT) */
                 {
                     write_flash_page();
                 }
             }
 #endif /* (USE_CLOCKSTRETCH) */
 
+#if (ERASE_AHEAD)
+            /* incomplete page: erased but not written, wait for the erase */
+            if (page_state & PAGE_ERASE)
+            {
+                page_state = 0;
+
+                TWI_busy_begin(control);
+                spm_busy_wait();
+                boot_rww_enable();
+            }
+#endif /* (ERASE_AHEAD) */
+
+#if (STATUS_SUPPORT)
+            if (bcnt > DATA_START)
+            {
+                /* after a write the next SLA+R reads the status (crc: the result) */
+#if (CRC_SUPPORT)
+                if (cmd != CMD_ACCESS_CRC)
+#endif /* (CRC_SUPPORT) */
+                {
+                    cmd = CMD_READ_STATUS;
+                }
+            }
+
+            if (status & STATUS_BUSY)
+            {
+                /* finish an open status read, the bus is already released */
+                while (status & STATUS_XFER)
+                {
+                    TWI_busy_poll();
+                }
+
+                status &= ~(STATUS_BUSY);
+                bcnt = 0;
+                LED_RT_OFF();
+                return;
+            }
+#endif /* (STATUS_SUPPORT) */
+
             bcnt = 0;
             /* fall through */
 
         /* prev. SLA+R, data sent, NACK returned -> IDLE */
         case 0xC0:
+#if (GROUP_ADDRESS_SUPPORT)
+        /* prev. SLA+R, last data sent, ACK returned -> IDLE */
+        case 0xC8:
+#endif /* (GROUP_ADDRESS_SUPPORT) */
             LED_RT_OFF();
             control |= (1<<TWEA);
             break;
@@ -470,7 +2695,11 @@ static void TWI_vect(void)
 /* *************************************************************************
  * TIMER0_OVF_vect
  * ************************************************************************* */
+#if (USE_INTERRUPTS)
+ISR(TIMER0_OVF_vect)
+#else
 static void TIMER0_OVF_vect(void)
+#endif
 {
     /* restart timer */
     TCNT0 = 0xFF - TIMER_MSEC2TICKS(TIMER_IRQFREQ_MS);
@@ -491,6 +2720,105 @@ static void TIMER0_OVF_vect(void)
 } /* TIMER0_OVF_vect */
 
 
+#if (BUS_IDLE_US)
+/* *************************************************************************
+ * wait_bus_idle
+ * ************************************************************************* */
+static void wait_bus_idle(void)
+{
+    uint8_t idle = BUS_IDLE_LOOPS;
+    uint16_t timeout = 0x0000;
+
+    /* SDA and SCL high for BUS_IDLE_US (the master sent its STOP),
+     * give up after 65536 loops if the bus is stuck
+     */
+    do {
+        if ((TWI_PIN & ((1<<TWI_SDA) | (1<<TWI_SCL))) != ((1<<TWI_SDA) | (1<<TWI_SCL)))
+        {
+            idle = BUS_IDLE_LOOPS;
+        }
+        else if (--idle == 0)
+        {
+            break;
+        }
+    } while (--timeout);
+} /* wait_bus_idle */
+#endif /* (BUS_IDLE_US) */
+
+
+#if (STAGED_UPDATE_SUPPORT)
+/* *************************************************************************
+ * stage_apply
+ * ************************************************************************* */
+/*
+ * Copy a verified staged image into the application section. Identical
+ * pages are skipped, after a power loss the copy resumes with the first
+ * page not yet written. The header is erased when all pages are copied.
+ */
+static void stage_apply(void)
+{
+    uint16_t pages = read_flash_word(STAGE_HEADER);
+    uint16_t sum = 0xFFFF;
+    addr_t end = (addr_t)pages * SPM_PAGESIZE;
+    addr_t pos;
+
+    if ((read_flash_word(STAGE_HEADER + 4) != STAGE_MAGIC) ||
+        (pages == 0) || (pages > STAGE_PAGES))
+    {
+        return;
+    }
+
+    for (pos = STAGE_START; pos < (STAGE_START + end); pos++)
+    {
+        sum = _crc_xmodem_update(sum, read_flash_byte(pos));
+    }
+
+    /* incomplete or corrupted staged image: keep the application */
+    if (sum != read_flash_word(STAGE_HEADER + 2))
+    {
+        return;
+    }
+
+    for (pos = 0; pos < end; pos += SPM_PAGESIZE)
+    {
+        pos_t i;
+
+        for (i = 0; i < SPM_PAGESIZE; i += 2)
+        {
+            if (read_flash_word(pos + i) != read_flash_word(STAGE_START + pos + i))
+            {
+                break;
+            }
+        }
+
+        if (i == SPM_PAGESIZE)
+        {
+            continue;
+        }
+
+        boot_page_erase(pos);
+        boot_spm_busy_wait();
+
+        /* staged image is read from the RWW section */
+        boot_rww_enable();
+
+        for (i = 0; i < SPM_PAGESIZE; i += 2)
+        {
+            boot_page_fill(pos + i, read_flash_word(STAGE_START + pos + i));
+        }
+
+        boot_page_write(pos);
+        boot_spm_busy_wait();
+        boot_rww_enable();
+    }
+
+    boot_page_erase(STAGE_HEADER);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+} /* stage_apply */
+#endif /* (STAGED_UPDATE_SUPPORT) */
+
+
 static void (*jump_to_app)(void) __attribute__ ((noreturn)) = 0x0000;
 
 
@@ -513,19 +2841,79 @@ void init1(void)
 } /* init1 */
 
 
+#if (USE_INTERRUPTS)
+#define STR_(x)             #x
+#define STR(x)              STR_(x)
+
+/* *************************************************************************
+ * vector_table
+ * ************************************************************************* */
+/*
+ * Interrupt vectors at the start of the bootloader section (IVSEL),
+ * only the used ones. Reset continues with the .init sections.
+ */
+void vector_table(void) __attribute__((naked, section(".vectors")));
+void vector_table(void)
+{
+    asm volatile (
+        "rjmp init1\n\t"
+        ".org " STR(TIMER0_OVF_vect_num) " * " STR(_VECTOR_SIZE) "\n\t"
+        "rjmp " STR(TIMER0_OVF_vect) "\n\t"
+        ".org " STR(TWI_vect_num) " * " STR(_VECTOR_SIZE) "\n\t"
+        "rjmp " STR(TWI_vect) "\n\t"
+    );
+} /* vector_table */
+#endif /* (USE_INTERRUPTS) */
+
+
+#if (SERVICE_TABLE_SUPPORT)
+/* *************************************************************************
+ * service_table
+ * ************************************************************************* */
+/*
+ * Fixed entry points in the last 8 bytes of the flash (section .services,
+ * placed by the Makefile), the application calls them as functions:
+ * FLASHEND -7: uint8_t page_erase(addr_t address), 0x00 ok / 0x01 refused
+ * FLASHEND -5: void page_fill(addr_t address, uint16_t data)
+ * FLASHEND -3: uint8_t page_write(addr_t address), 0x00 ok / 0x01 refused
+ * FLASHEND -1: void eeprom_write(uint16_t address, uint8_t val)
+ */
+void service_table(void) __attribute__((naked, section(".services")));
+void service_table(void)
+{
+    asm volatile (
+        "rjmp service_page_erase\n\t"
+        "rjmp service_page_fill\n\t"
+        "rjmp service_page_write\n\t"
+#if (EEPROM_SUPPORT)
+        "rjmp service_eeprom_write\n\t"
+#else
+        "ret\n\t"
+#endif /* (EEPROM_SUPPORT) */
+    );
+} /* service_table */
+#endif /* (SERVICE_TABLE_SUPPORT) */
+
+
 /*
  * For newer devices the watchdog timer remains active even after a
  * system reset. So disable it as soon as possible.
  * automagically called on startup
  */
 #if defined (__AVR_ATmega88__) || defined (__AVR_ATmega168__) || \
-    defined (__AVR_ATmega328P__)
+    defined (__AVR_ATmega328P__) || defined (__AVR_ATmega644P__) || \
+    defined (__AVR_ATmega1284P__) || defined (__AVR_ATmega2560__)
 /* *************************************************************************
  * disable_wdt_timer
  * ************************************************************************* */
 void disable_wdt_timer(void) __attribute__((naked, section(".init3")));
 void disable_wdt_timer(void)
 {
+#if (FAST_BOOT)
+    /* keep reset cause for main(), .bss is not initialized yet */
+    GPIOR0 = MCUSR;
+#endif /* (FAST_BOOT) */
+
     MCUSR = 0;
     WDTCSR = (1<<WDCE) | (1<<WDE);
     WDTCSR = (0<<WDE);
@@ -539,6 +2927,34 @@ void disable_wdt_timer(void)
 int main(void) __attribute__ ((OS_main, section (".init9")));
 int main(void)
 {
+#if (ADDRESS_STRAP_PINS)
+    /* pull-ups on, read after STRAP_SETTLE_US in set_slave_address() */
+    STRAP_INIT();
+#endif /* (ADDRESS_STRAP_PINS) */
+
+#if (STAGED_UPDATE_SUPPORT)
+    /* before the marker of the application is checked */
+    stage_apply();
+#endif /* (STAGED_UPDATE_SUPPORT) */
+
+#if (FAST_BOOT)
+#if defined (GPIOR0)
+    uint8_t reset_cause = GPIOR0;
+#else
+    uint8_t reset_cause = MCUCSR;
+
+    /* like MCUSR in .init3: a watchdog reset is only seen once */
+    MCUCSR = 0;
+#endif
+
+    /* valid application and no request by watchdog reset: start it now */
+    app_valid = (read_flash_word(APP_MAGIC_ADDR) == APP_MAGIC);
+    if (app_valid && !(reset_cause & (1<<WDRF)))
+    {
+        cmd = CMD_BOOT_APPLICATION;
+    }
+#endif /* (FAST_BOOT) */
+
     LED_INIT();
     LED_GN_ON();
 
@@ -551,8 +2967,81 @@ int main(void)
 #error "TCCR0(B) not defined"
 #endif
 
+#if (ADDRESS_STRAP_PINS)
+    /* strap inputs need time to charge through the internal pull-ups */
+    _delay_us(STRAP_SETTLE_US);
+#endif /* (ADDRESS_STRAP_PINS) */
+
     /* TWI init: set address, auto ACKs */
-    TWAR = (TWI_ADDRESS<<1);
+    set_slave_address();
+#if (USE_INTERRUPTS)
+    TWCR = (1<<TWIE) | (1<<TWEA) | (1<<TWEN);
+
+    /* interrupt vectors in the bootloader section */
+#if defined (GICR)
+    GICR = (1<<IVCE);
+    GICR = (1<<IVSEL);
+#else
+    MCUCR = (1<<IVCE);
+    MCUCR = (1<<IVSEL);
+#endif
+
+#if defined (TIMSK)
+    TIMSK = (1<<TOIE0);
+#else
+    TIMSK0 = (1<<TOIE0);
+#endif
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+
+    while (cmd != CMD_BOOT_APPLICATION)
+    {
+        cli();
+#if (FLASH_STREAM_SUPPORT)
+        stream_flash_poll();
+#endif /* (FLASH_STREAM_SUPPORT) */
+#if (EEPROM_STREAM_SUPPORT)
+        stream_eeprom_poll();
+#endif /* (EEPROM_STREAM_SUPPORT) */
+
+        /* SPM / eeprom done is not an interrupt source, keep polling */
+        if ((cmd != CMD_BOOT_APPLICATION)
+#if (FLASH_STREAM_SUPPORT)
+            && (spm_state == SPM_IDLE)
+#endif /* (FLASH_STREAM_SUPPORT) */
+#if (EEPROM_STREAM_SUPPORT)
+            && (ee_tail == ee_head)
+#endif /* (EEPROM_STREAM_SUPPORT) */
+           )
+        {
+            /* interrupts are enabled after the next instruction:
+             * a wakeup can not get lost between sei() and sleep
+             */
+            sei();
+            sleep_cpu();
+        }
+        sei();
+    }
+
+    cli();
+    sleep_disable();
+
+#if defined (TIMSK)
+    TIMSK = 0x00;
+#else
+    TIMSK0 = 0x00;
+#endif
+
+    /* interrupt vectors back in the application section */
+#if defined (GICR)
+    GICR = (1<<IVCE);
+    GICR = 0x00;
+#else
+    MCUCR = (1<<IVCE);
+    MCUCR = 0x00;
+#endif
+#else
     TWCR = (1<<TWEA) | (1<<TWEN);
 
     while (cmd != CMD_BOOT_APPLICATION)
@@ -562,6 +3051,14 @@ int main(void)
             TWI_vect();
         }
 
+#if (FLASH_STREAM_SUPPORT)
+        stream_flash_poll();
+#endif /* (FLASH_STREAM_SUPPORT) */
+
+#if (EEPROM_STREAM_SUPPORT)
+        stream_eeprom_poll();
+#endif /* (EEPROM_STREAM_SUPPORT) */
+
 #if defined (TIFR)
         if (TIFR & (1<<TOV0))
         {
@@ -578,10 +3075,21 @@ int main(void)
 #error "TIFR(0) not defined"
 #endif
     }
+#endif /* (USE_INTERRUPTS) */
 
     /* Disable TWI but keep address! */
     TWCR = 0x00;
 
+#if (GENERAL_CALL_SUPPORT)
+    /* the application enables general call reception itself */
+    TWAR &= ~(1<<TWGCE);
+#endif /* (GENERAL_CALL_SUPPORT) */
+
+#if (GROUP_ADDRESS_SUPPORT)
+    /* the application only gets its own address */
+    TWAMR = 0x00;
+#endif /* (GROUP_ADDRESS_SUPPORT) */
+
     /* disable timer0 */
 #if defined (TCCR0)
     TCCR0 = 0x00;
@@ -593,10 +3101,22 @@ int main(void)
 
     LED_OFF();
 
-    uint16_t wait = 0x0000;
-    do {
-        __asm volatile ("nop");
-    } while (--wait);
+#if (EEPROM_SUPPORT) && (EEPROM_SKIP_UNCHANGED) && defined (EEPM1)
+    /* EEPM bits can not be changed while a write is in progress,
+     * the application gets the default (erase + write) mode
+     */
+    eeprom_busy_wait();
+    EECR = 0x00;
+#endif /* (EEPROM_SUPPORT) && (EEPROM_SKIP_UNCHANGED) && defined (EEPM1) */
+
+#if (ADDRESS_STRAP_PINS)
+    STRAP_OFF();
+#endif /* (ADDRESS_STRAP_PINS) */
+
+#if (BUS_IDLE_US)
+    /* do not hand over an active transaction to the application */
+    wait_bus_idle();
+#endif /* (BUS_IDLE_US) */
 
     jump_to_app();
 } /* main */
@@ -0,0 +1,458 @@
+/***************************************************************************
+ *   simavr based benchmark of the real twiboot firmware image             *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; version 2 of the License,               *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_twi.h"
+
+/*
+ * Boots twiboot.elf cycle accurate in simavr and acts as TWI master on the
+ * simulated bus. The master honors the bus bit time and waits while the
+ * slave stretches the clock (TWINT set), a NACKed address is retried after
+ * POLL_GAP_US like a real master polling a busy slave.
+ *
+ * simavr programs the flash instantly and clears SPMEN right after the SPM
+ * instruction. The harness detects page erase / page write SPM instructions
+ * and keeps SPMEN set for SPM_PAGE_US, so the firmware busy waits as long as
+ * on real hardware.
+ */
+
+#define TWI_ADDRESS             0x29
+#define F_CPU                   8000000UL
+#define POLL_GAP_US             50
+#define BOOT_LIMIT_MS           5000
+
+#define SPMCSR_ADDR             0x57        /* SPMCR / SPMCSR, all supported MCUs */
+#define SPMEN                   0x01
+#define PGERS                   0x02
+#define PGWRT                   0x04
+#define SPM_OPCODE              0x95E8
+#define SPM_OPCODE_ZINC         0x95F8      /* SPM Z+ */
+#define SPM_PAGE_US             4500        /* page erase / write, datasheet max. */
+#define TWINT                   0x80
+
+#define CMD_WAIT                0x00
+#define CMD_ACCESS_MEMORY       0x02
+#define MEMTYPE_FLASH           0x01
+
+enum {
+    OP_START_W,
+    OP_START_R,
+    OP_TX,
+    OP_RX_ACK,
+    OP_RX_NACK,
+    OP_STOP,
+};
+
+struct bus_op
+{
+    uint8_t type;
+    uint8_t data;
+};
+
+struct stats
+{
+    avr_cycle_count_t cycles;
+    avr_cycle_count_t main_cycles;      /* PC inside main() incl. inlined TWI handlers, SPM idle */
+    avr_cycle_count_t spm_cycles;       /* page erase / write in progress */
+    uint32_t pages;
+    uint32_t polls;
+    uint32_t bytes;
+};
+
+static const char *mcu_name = "atmega328p";
+static const char *elf_name = "twiboot.elf";
+static uint32_t main_start;
+static uint32_t main_end;
+static uint16_t twcr_addr;
+
+static avr_t *avr;
+static avr_irq_t *twi_in;
+static avr_irq_t *twi_out;
+static uint32_t flashbase;
+static avr_cycle_count_t spm_busy_until;
+
+static struct bus_op *ops;
+static uint32_t op_count;
+static uint32_t op_head;
+static uint8_t slave_ack;
+static uint8_t slave_data;
+
+
+static void twi_out_notify(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+    avr_twi_msg_irq_t msg;
+
+    msg.u.v = value;
+    if (msg.u.twi.msg & TWI_COND_ACK)
+    {
+        slave_ack = msg.u.twi.data;
+    }
+
+    if (msg.u.twi.msg & TWI_COND_READ)
+    {
+        slave_data = msg.u.twi.data;
+    }
+}
+
+
+static void sim_reset(void)
+{
+    static elf_firmware_t fw;
+    static int loaded;
+
+    if (!loaded)
+    {
+        if (elf_read_firmware(elf_name, &fw) != 0)
+        {
+            fprintf(stderr, "failed to read %s\n", elf_name);
+            exit(1);
+        }
+        loaded = 1;
+    }
+
+    if (avr == NULL)
+    {
+        avr = avr_make_mcu_by_name(mcu_name);
+        if (avr == NULL)
+        {
+            fprintf(stderr, "unknown mcu %s\n", mcu_name);
+            exit(1);
+        }
+
+        avr_init(avr);
+        avr->frequency = F_CPU;
+        avr_load_firmware(avr, &fw);
+
+        twi_in = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT);
+        twi_out = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_OUTPUT);
+        avr_irq_register_notify(twi_out, twi_out_notify, NULL);
+    }
+
+    /* BOOTRST programmed: reset vector is the start of the bootloader */
+    flashbase = fw.flashbase;
+    memset(avr->flash, 0xFF, flashbase);
+    avr->reset_pc = flashbase;
+    avr_reset(avr);
+    avr->pc = flashbase;
+    spm_busy_until = 0;
+
+    /* TWCR: atmega8 I/O space, others extended I/O space */
+    twcr_addr = (strcmp(mcu_name, "atmega8") == 0) ? 0x56 : 0xBC;
+}
+
+
+static avr_cycle_count_t us2cycles(uint32_t us)
+{
+    return (avr_cycle_count_t)us * (F_CPU / 1000000UL);
+}
+
+
+static void bus_add(uint8_t type, uint8_t data)
+{
+    ops = realloc(ops, (op_count +1) * sizeof(struct bus_op));
+    ops[op_count].type = type;
+    ops[op_count].data = data;
+    op_count++;
+}
+
+
+static void bus_write(const uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+
+    bus_add(OP_START_W, TWI_ADDRESS);
+    for (i = 0; i < len; i++)
+    {
+        bus_add(OP_TX, data[i]);
+    }
+    bus_add(OP_STOP, 0);
+}
+
+
+/* page erase / write pending: SPM instruction at PC with SPMEN and PGERS / PGWRT set */
+static int spm_page_op(void)
+{
+    uint16_t opcode = avr->flash[avr->pc] | (avr->flash[avr->pc +1] << 8);
+    uint8_t spmcsr = avr->data[SPMCSR_ADDR];
+
+    return ((opcode == SPM_OPCODE) || (opcode == SPM_OPCODE_ZINC)) &&
+           (spmcsr & SPMEN) && (spmcsr & (PGERS | PGWRT));
+}
+
+
+/* one simulation step, returns 0 when the firmware left the bootloader */
+static int sim_step(struct stats *st)
+{
+    avr_cycle_count_t start = avr->cycle;
+    int busy = (start < spm_busy_until);
+    int state;
+    avr_cycle_count_t delta;
+
+    if (busy)
+    {
+        /* simavr cleared SPMEN already, keep it set until the operation has finished */
+        avr->data[SPMCSR_ADDR] |= SPMEN;
+    }
+    else if (spm_busy_until != 0)
+    {
+        avr->data[SPMCSR_ADDR] &= ~SPMEN;
+        spm_busy_until = 0;
+    }
+
+    if (!busy && spm_page_op())
+    {
+        spm_busy_until = start + us2cycles(SPM_PAGE_US);
+    }
+
+    state = avr_run(avr);
+    delta = avr->cycle - start;
+
+    if ((state == cpu_Done) || (state == cpu_Crashed) || (avr->pc < flashbase))
+    {
+        return 0;
+    }
+
+    st->cycles += delta;
+    if (busy || (spm_busy_until != 0))
+    {
+        st->spm_cycles += delta;
+    }
+    else if ((avr->pc >= main_start) && (avr->pc < main_end))
+    {
+        st->main_cycles += delta;
+    }
+
+    return 1;
+}
+
+
+static uint8_t bus_step(uint32_t bus_hz, avr_cycle_count_t *next, struct stats *st)
+{
+    avr_cycle_count_t bit = F_CPU / bus_hz;
+    struct bus_op *op = &ops[op_head];
+
+    slave_ack = 0;
+    switch (op->type)
+    {
+        case OP_START_W:
+        case OP_START_R:
+            avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_START | TWI_COND_ADDR,
+                                                  (op->data << 1) | (op->type == OP_START_R), 0));
+            if (!slave_ack)
+            {
+                /* address NACKed: STOP, retry later */
+                avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_STOP, op->data << 1, 0));
+                *next = avr->cycle + 11 * bit + us2cycles(POLL_GAP_US);
+                st->polls++;
+                return 0;
+            }
+            *next = avr->cycle + 10 * bit;
+            break;
+
+        case OP_TX:
+            avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_WRITE, TWI_ADDRESS << 1, op->data));
+            *next = avr->cycle + 9 * bit;
+            st->bytes++;
+
+            if (!slave_ack)
+            {
+                /* data NACKed, skip to STOP */
+                while (ops[op_head +1].type != OP_STOP)
+                {
+                    op_head++;
+                }
+            }
+            break;
+
+        case OP_RX_ACK:
+        case OP_RX_NACK:
+            avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_READ | ((op->type == OP_RX_ACK) ? TWI_COND_ACK : 0),
+                                                  (TWI_ADDRESS << 1) | 1, 0));
+            *next = avr->cycle + 9 * bit;
+            st->bytes++;
+            break;
+
+        case OP_STOP:
+            avr_raise_irq(twi_in, avr_twi_irq_msg(TWI_COND_STOP, TWI_ADDRESS << 1, 0));
+            *next = avr->cycle + bit + us2cycles(POLL_GAP_US);
+            break;
+    }
+
+    op_head++;
+    return 1;
+}
+
+
+/* run the queued bus operations, returns 0 if the bootloader was left */
+static int bus_run(uint32_t bus_hz, struct stats *st)
+{
+    avr_cycle_count_t next = avr->cycle;
+
+    while (op_head < op_count)
+    {
+        if (!sim_step(st))
+        {
+            return 0;
+        }
+
+        /* slave stretches the clock while TWINT is set */
+        if ((avr->cycle >= next) && !(avr->data[twcr_addr] & TWINT))
+        {
+            bus_step(bus_hz, &next, st);
+        }
+    }
+
+    /* wait for the last page write to complete */
+    while ((avr->cycle < next) || (avr->cycle < spm_busy_until))
+    {
+        if (!sim_step(st))
+        {
+            return 0;
+        }
+    }
+
+    op_head = op_count = 0;
+    return 1;
+}
+
+
+static void bench_boot(void)
+{
+    struct stats st = { 0 };
+
+    sim_reset();
+    while (st.cycles < us2cycles(BOOT_LIMIT_MS * 1000UL))
+    {
+        if (!sim_step(&st))
+        {
+            break;
+        }
+    }
+
+    printf("%-10s boot-to-app latency %8.2f ms (%llu cycles)\n",
+           mcu_name, st.cycles * 1000.0 / F_CPU, (unsigned long long)st.cycles);
+}
+
+
+static int bench_flash(uint32_t size, uint32_t bus_hz, uint16_t pagesize)
+{
+    uint8_t *image = malloc(size);
+    uint8_t msg[5 + 256];
+    struct stats st = { 0 };
+    uint32_t seed = size;
+    uint32_t pos;
+    int ok;
+
+    for (pos = 0; pos < size; pos++)
+    {
+        seed = seed * 1103515245 + 12345;
+        image[pos] = seed >> 16;
+    }
+
+    sim_reset();
+
+    msg[0] = CMD_WAIT;
+    bus_write(msg, 1);
+
+    msg[0] = CMD_ACCESS_MEMORY;
+    msg[1] = MEMTYPE_FLASH;
+    for (pos = 0; pos < size; pos += pagesize)
+    {
+        uint8_t len = 2;
+
+        /* 3 address bytes on devices with more than 64kB flash */
+        if (flashbase > 0x10000)
+        {
+            msg[len++] = pos >> 16;
+        }
+        msg[len++] = pos >> 8;
+        msg[len++] = pos & 0xFF;
+        memcpy(&msg[len], &image[pos], pagesize);
+        bus_write(msg, len + pagesize);
+        st.pages++;
+    }
+
+    ok = bus_run(bus_hz, &st) && (memcmp(avr->flash, image, size) == 0);
+
+    printf("%-10s %6u bytes @ %3u kHz: %8.1f ms, %7.0f bytes/s, main()+handlers %9llu cycles, "
+           "SPM busy %6.2f ms/page, %6u polls %s\n",
+           mcu_name, size, bus_hz / 1000,
+           st.cycles * 1000.0 / F_CPU,
+           size * (double)F_CPU / st.cycles,
+           (unsigned long long)st.main_cycles,
+           st.pages ? (st.spm_cycles * 1000.0 / F_CPU) / st.pages : 0.0,
+           st.polls, ok ? "ok" : "FAILED");
+
+    free(image);
+    return ok ? 0 : 1;
+}
+
+
+int main(int argc, char *argv[])
+{
+    static const uint32_t bus_speeds[] = { 100000, 400000 };
+    static const uint32_t sizes[] = { 1024, 4096, 0 };
+    uint16_t pagesize;
+    unsigned int i, j;
+    int fail = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:m:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                elf_name = optarg;
+                break;
+
+            case 'm':
+                mcu_name = optarg;
+                break;
+
+            case 'r':
+                /* address range of main(): "start:size" from avr-nm -S */
+                if (sscanf(optarg, "%x:%x", &main_start, &main_end) == 2)
+                {
+                    main_end += main_start;
+                }
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-e twiboot.elf] [-m mcu] [-r main_start:main_size]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    sim_reset();
+    pagesize = (strcmp(mcu_name, "atmega8") == 0) ? 64 : (strcmp(mcu_name, "atmega88") == 0) ? 64 :
+               (strcmp(mcu_name, "atmega168") == 0) ? 128 : (strcmp(mcu_name, "atmega328p") == 0) ? 128 : 256;
+
+    bench_boot();
+
+    for (i = 0; i < sizeof(bus_speeds) / sizeof(bus_speeds[0]); i++)
+    {
+        for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+        {
+            /* 0: whole application section */
+            fail |= bench_flash(sizes[j] ? sizes[j] : flashbase, bus_speeds[i], pagesize);
+        }
+    }
+
+    return fail;
+}